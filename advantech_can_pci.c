@@ -26,75 +26,4850 @@
 #include <linux/interrupt.h>
 #include <linux/netdevice.h>
 #include <linux/pci.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/idr.h>
+#include <linux/perf_event.h>
+#include <linux/static_key.h>
+#include <linux/ethtool.h>
+#include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/random.h>
+#include <linux/version.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <linux/hashtable.h>
+#include <linux/vmalloc.h>
+#include <linux/sizes.h>
+#include <linux/mm.h>
+#include <linux/miscdevice.h>
+#include <linux/if_arp.h>
 #include <linux/can/dev.h>
+#include <linux/can/led.h>
 
 #include "sja1000.h"
+#include "advantech_can_pci.h"
 
 #define DRV_NAME  "advantech_can_pci"
 
+#if IS_ENABLED(CONFIG_BPF_SYSCALL) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+#define ADV_RX_BPF
+#endif
+
 MODULE_AUTHOR("Marko Kohtala <marko.kohtala@gmail.com>");
 MODULE_DESCRIPTION("Socket-CAN driver for Advantech MIOe-3680 CAN cards");
 MODULE_SUPPORTED_DEVICE("Advantech MIOe-3680 CAN card");
 MODULE_LICENSE("GPL v2");
 
-struct adv_pci_card {
-	void __iomem *can_addr;
-	struct net_device *net_dev[4];
+static unsigned int watchdog_ms = 500;
+module_param(watchdog_ms, uint, 0444);
+MODULE_PARM_DESC(watchdog_ms,
+		 "Controller stall check interval in ms, 0 disables");
+
+static bool irq_thread;
+module_param(irq_thread, bool, 0444);
+MODULE_PARM_DESC(irq_thread, "Serve the ports of all cards in one thread");
+
+static int irq_thread_cpu = -1;
+module_param(irq_thread_cpu, int, 0444);
+MODULE_PARM_DESC(irq_thread_cpu,
+		 "CPU for the interrupt thread and interrupts, -1 for any");
+
+static unsigned int irq_thread_budget = 8;
+module_param(irq_thread_budget, uint, 0444);
+MODULE_PARM_DESC(irq_thread_budget,
+		 "Frames received from a port per interrupt thread turn");
+
+static bool capture;
+module_param(capture, bool, 0444);
+MODULE_PARM_DESC(capture, "Create a bulk capture device for each card");
+
+static unsigned int capture_batch = 64;
+module_param(capture_batch, uint, 0444);
+MODULE_PARM_DESC(capture_batch, "Frames in a capture packet");
+
+/* A batch sizes an atomic skb and the MTU of the capture device */
+#define ADV_CAP_BATCH_MAX	(SZ_64K / sizeof(struct adv_can_capture_rec))
+
+static unsigned int capture_timeout_us = 1000;
+module_param(capture_timeout_us, uint, 0644);
+MODULE_PARM_DESC(capture_timeout_us,
+		 "Time in us before a partial capture packet is sent");
+
+/* Arbitration losses are counted per transmitted and winning ID pair */
+#define ADV_ALC_PAIRS	64
+#define ADV_ALC_UNKNOWN	CAN_ERR_FLAG	/* winner not seen */
+
+struct adv_alc_pair {
+	canid_t tx_id;
+	canid_t winner;
+	u64 count;
+	u8 bit_min;
+	u8 bit_max;
+};
+
+/* Receive filter on identifier and payload */
+#define ADV_RX_FILTERS	32
+
+struct adv_rx_filter {
+	canid_t id;
+	canid_t id_mask;
+	u64 data;		/* payload bytes in memory order */
+	u64 data_mask;
+};
+
+struct adv_rx_filters {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct adv_rx_filter rule[ADV_RX_FILTERS];
+};
+
+/* ISO-TP flow control responders, normal addressing */
+#define ADV_ISOTP_FC	8
+#define ADV_ISOTP_FC_PENDING	4	/* waiting for the TX buffer */
+
+struct adv_isotp_fc {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct {
+		canid_t rx_id;		/* first frames come with this */
+		struct can_frame fc;	/* flow control to send */
+	} resp[ADV_ISOTP_FC];
+};
+
+/* Ethtool self test waiting for its frame in the receive hooks */
+struct adv_test {
+	struct completion done;
+	canid_t id;		/* frame expected back */
+	u64 start;		/* handed to the device */
+	u64 ns;			/* received */
+	struct can_frame rx;
+};
+
+/* In-kernel consumer, see advantech_can_pci.h */
+struct adv_can_rx_hook {
+	struct list_head list;
+	struct rcu_head rcu;
+	struct adv_pci_port *port;
+	canid_t id;
+	canid_t mask;
+	adv_can_rx_fn fn;
+	void *data;
+};
+
+/* Identifier ranges kept when the receive backlog is over the watermark */
+#define ADV_RX_PRIO_RANGES	16
+
+struct adv_rx_prio {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct {
+		canid_t first;
+		canid_t last;
+	} range[ADV_RX_PRIO_RANGES];
+};
+
+/* Identifier subscribed to the latest value table */
+struct adv_lv_sub {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	canid_t id;
+	unsigned int index;	/* in the table */
+	bool only;		/* not passed to the stack */
+};
+
+/* Misc device mapping the latest value table of a port. Open files keep
+ * it, port is cleared under adv_rx_hook_lock when the card goes away.
+ */
+struct adv_lv_dev {
+	struct miscdevice misc;
+	char name[24];
+	struct kref ref;
+	struct adv_pci_port *port;
+};
+
+/* Transmit rate limit of one identifier */
+struct adv_tx_limit {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	canid_t id;
+	u32 rate;		/* frames/s */
+	u32 burst;		/* frames sent back to back */
+	u64 interval_ns;
+	u64 tat;		/* theoretical arrival time of the next frame */
+	u64 passed;
+	u64 dropped;
+};
+
+/* Error counter samples kept per port */
+#define ADV_TREND_LEN	64
+
+struct adv_err_sample {
+	u64 ns;
+	u8 txerr;
+	u8 rxerr;
+	u8 state;
+};
+
+/* Latency histograms have log2 buckets: bucket 0 counts 0 ns, bucket n
+ * counts [2^(n-1), 2^n) ns and the last bucket everything above that.
+ */
+#define ADV_HIST_BUCKETS	32
+
+struct adv_hist {
+	u64 bucket[ADV_HIST_BUCKETS];
+};
+
+enum adv_pktgen_mode {
+	ADV_PKTGEN_FIXED,
+	ADV_PKTGEN_INC,
+	ADV_PKTGEN_RANDOM,
+};
+
+/* In-kernel frame generator feeding the port transmit function */
+struct adv_pktgen {
+	struct mutex lock;		/* configuration and thread */
+	struct task_struct *task;
+	wait_queue_head_t tx_wait;	/* for the queue to be woken */
+
+	canid_t id;			/* including CAN_EFF_FLAG */
+	canid_t id_mask;		/* bits varied by id_mode */
+	enum adv_pktgen_mode id_mode;
+	u8 dlc;
+	u8 data[CAN_MAX_DLEN];
+	enum adv_pktgen_mode data_mode;
+	u32 rate;			/* frames per second, 0 for max */
+	u64 count;			/* 0 for no limit */
+	u32 burst;
+
+	/* Results, written by the thread under stats_lock */
+	spinlock_t stats_lock;
+	u64 sent;
+	u64 bits;			/* on the bus, stuffing included */
+	u64 alloc_failed;
+	u64 start_ns;
+	u64 end_ns;
+};
+
+struct adv_pci_card;
+
+struct adv_pci_port {
+	struct adv_pci_card *card;
+	struct net_device *dev;
+	int index;
+
+	/* Set while the card interrupt handler services this port */
+	bool in_isr;
+	u64 irq_entry;		/* local_clock() at handler entry */
+	unsigned int irq_frames;	/* received in this invocation */
+	unsigned int irq_frames_max;
+
+	/* The core only reads IER to see if interrupts are off, so it is
+	 * served from this copy. IR read by the card handler is kept for
+	 * the next IR read of the core, as reading clears it. With the
+	 * interrupt thread, the hard handler adds to it under ir_lock.
+	 */
+	u8 ier;
+	u8 ir_pending;
+	bool ir_stashed;
+	u64 ir_time;		/* hard interrupt with the thread */
+	spinlock_t ir_lock;
+	int isr_cpu;
+
+	/* Received frames are read ahead of the core when a receive hook
+	 * is active. Hooks may consume the frame; otherwise the registers
+	 * are kept here for the core to read.
+	 */
+	bool rx_hooks;
+	u8 rx_cache[13];	/* FI, ID and data registers */
+	u8 rx_cache_len;
+
+	/* Stall watchdog */
+	u64 irq_count;
+	u64 irq_count_seen;
+	unsigned int stall_checks;
+	u64 stalls;
+	bool reinit_failed;	/* retried at each check */
+
+	/* Bus health */
+	u8 ewl;			/* error warning limit */
+	u8 err_warn;		/* error counter level to warn at */
+	bool err_warned;
+	u64 ecc_type[4];	/* bit, form, stuff, other errors */
+	u64 ecc_dir[2];		/* in transmission, in reception */
+	u64 ecc_seg[32];
+	u64 alc_bit[32];
+	struct adv_err_sample trend[ADV_TREND_LEN];
+	unsigned int trend_next;
+	unsigned int trend_count;
+
+	/* Arbitration loss analytics */
+	canid_t tx_id;		/* frame last given to the controller */
+	bool alc_read;		/* ALC taken at the IR read */
+	bool alc_pending;	/* waiting for the winning frame */
+	canid_t alc_tx_id;
+	u8 alc_pos;
+	struct adv_alc_pair alc[ADV_ALC_PAIRS];
+	u64 alc_overflow;	/* losses not fitting the table */
+
+	/* Per identifier TX rate limits, looked up under RCU */
+	DECLARE_HASHTABLE(tx_limits, 6);
+	unsigned int tx_limit_count;
+
+	/* Serialises the transmit checks of adv_start_xmit() and
+	 * adv_can_xmit(), which also runs in the interrupt handler.
+	 */
+	spinlock_t tx_lock;
+
+	/* TX pacing */
+	u8 tx_load_limit;	/* percent of bus time, 0 for no limit */
+	u64 tx_tat;		/* earliest time of the next frame */
+	struct hrtimer tx_pace_timer;
+
+	/* Mode register transitions */
+	spinlock_t mode_lock;	/* counters, also from the watchdog */
+	u64 mode_switches;
+	u64 mode_ns_last;
+	u64 mode_ns_max;
+	u64 mode_polls;		/* reads after the first */
+	u64 mode_timeouts;
+
+	/* Bitrate switch on a running port */
+	bool tx_hold;		/* adv_start_xmit() holds the queue */
+	u64 br_switch_ns;	/* reset mode to operating mode, last switch */
+
+	/* Byte queue limits accounting of the frame in the TX buffer */
+	bool tx_bql;
+	unsigned int tx_bql_bytes;
+	struct net_device_ops netdev_ops;
+	const struct net_device_ops *core_ops;
+	int (*core_set_mode)(struct net_device *dev, enum can_mode mode);
+
+	struct adv_can_lv_table *lv_table;	/* vmalloc_user() */
+	DECLARE_HASHTABLE(lv_subs, 6);
+	struct adv_lv_dev *lv_dev;
+
+	struct list_head rx_cbs;	/* struct adv_can_rx_hook */
+	struct adv_test *test;		/* ethtool self test running */
+
+	struct adv_isotp_fc __rcu *isotp_fc;
+	spinlock_t fc_lock;	/* deferred flow control, before tx_lock */
+	struct can_frame fc_ring[ADV_ISOTP_FC_PENDING];
+	unsigned int fc_head;
+	unsigned int fc_count;
+	u64 fc_sent;
+	u64 fc_deferred;
+	u64 fc_overflow;	/* deferred frames lost to a full ring */
+
+	u8 rx_watermark;	/* percent of netdev_max_backlog */
+	struct adv_rx_prio __rcu *rx_prio;
+	u64 prio_high_kept;	/* over the watermark */
+	u64 prio_low_dropped;
+	bool rx_high;		/* class of the frame passed to the core */
+	struct softnet_data *rx_sd;	/* backlog it is queued to */
+	unsigned int rx_sd_dropped;
+	u64 prio_high_backlog_dropped;	/* by netif_rx() */
+	u64 prio_low_backlog_dropped;
+
+	/* Delivery lane for the priority ranges */
+	bool rx_fast_lane;
+	struct sk_buff_head fast_q;
+	struct tasklet_struct fast_tasklet;
+	u64 fast_lane;
+
+	struct adv_rx_filters __rcu *rx_filters;
+	u64 filter_pass;
+	u64 filter_drop;
+
+#ifdef ADV_RX_BPF
+	struct bpf_prog __rcu *rx_prog;
+	struct sk_buff *rx_prog_skb;	/* holds struct adv_can_rx_ctx */
+	u64 bpf_pass;
+	u64 bpf_drop;
+	u64 bpf_redirect;
+	u64 bpf_redirect_err;
+#endif
+
+	struct adv_hist __percpu *isr_hist;	/* sja1000_interrupt() */
+	struct adv_hist __percpu *rx_hist;	/* IRQ entry to RX handoff */
+	struct dentry *debugfs;
+
+	struct adv_pktgen pktgen;
+};
+
+struct adv_pci_card {
+	struct list_head list;	/* in adv_cards with irq_thread */
+	struct pci_dev *pdev;
+	void __iomem *can_addr;
+	int id;
+	int node;		/* NUMA node of the PCI device */
+	int nr_ports;
+	bool irq_requested;
+
+	struct adv_hist __percpu *isr_hist;	/* whole hard handler time */
+	struct adv_hist __percpu *thread_hist;	/* irq_thread pass time */
+	struct adv_hist __percpu *rx_hist;	/* all ports combined */
+	struct dentry *debugfs;
+
+	/* Worst case handler invocation, the line is never reentered */
+	u64 isr_ns_max;
+	u64 thread_ns_max;	/* card part of an irq_thread pass */
+	unsigned int irq_frames_max;
+
+	u64 foreign_irqs;	/* shared line interrupts that were not ours */
+
+	struct delayed_work watchdog;
+
+	/* Frames redirected by receive hooks, sent from a tasklet */
+	struct sk_buff_head redirect_q;
+	struct tasklet_struct redirect_tasklet;
+
+	/* Bulk capture device, records are added under cap_lock */
+	struct net_device *cap_dev;
+	bool cap_running;
+	spinlock_t cap_lock;
+	struct sk_buff *cap_skb;	/* packet being filled */
+	unsigned int cap_count;
+	struct hrtimer cap_timer;	/* sends a partial packet */
+
+	struct adv_pci_port port[4];
+};
+
+static struct dentry *adv_debugfs_root;
+static DEFINE_IDA(adv_card_ida);
+
+/* Serialises receive hook changes */
+static DEFINE_MUTEX(adv_rx_hook_lock);
+
+/* Cards served by the interrupt thread */
+static LIST_HEAD(adv_cards);
+static DEFINE_MUTEX(adv_cards_lock);
+static struct task_struct *adv_irq_task;
+static atomic_t adv_irq_work = ATOMIC_INIT(0);
+
+/* Software PMU counting driver events, e.g.
+ * perf stat -a -e advantech_can/mmio_reads,ports=0x3/
+ * The ports and cards fields are bit masks of port and card numbers,
+ * zero meaning all. Card numbers are given in probe order and the
+ * mask covers the first eight cards.
+ */
+enum adv_pmu_event {
+	ADV_PMU_MMIO_READ,
+	ADV_PMU_MMIO_WRITE,
+	ADV_PMU_IRQ,
+	ADV_PMU_RX_FRAME,
+	ADV_PMU_OVERRUN,
+	ADV_PMU_SPURIOUS_IRQ,
+	ADV_PMU_NR_EVENTS
+};
+
+#define ADV_PMU_EVENT(config)	((config) & 0xff)
+#define ADV_PMU_PORTS(config)	(((config) >> 8) & 0xf)
+#define ADV_PMU_CARDS(config)	(((config) >> 16) & 0xff)
+
+struct adv_pmu_events {
+	struct hlist_head head[ADV_PMU_NR_EVENTS];
+};
+
+static struct adv_pmu_events __percpu *adv_pmu_events;
+static struct static_key adv_pmu_active = STATIC_KEY_INIT_FALSE;
+
+/* SJA1000 internal clock is divided by 2 from external clock */
+#define ADV_PCI_CAN_CLOCK (16000000 / 2)
+
+/* The board configuration is following:
+ * RX1 is connected to ground.
+ * TX1 is not connected, but we do not leave it floating.
+ * CLKO forwards clock to PCI bridge.
+ */
+#define ADV_PCI_OCR         (OCR_TX0_PUSHPULL | OCR_TX1_PUSHPULL)
+
+/* In the CDR register, enable comparator by-pass for lower latency
+ * since we have external tranceiver.
+ * The clock divider value is set for direct oscillator output because the
+ * PCI bridge is driven by the second CLKOUT output.
+ */
+#define ADV_PCI_CDR             (CDR_CBP | CDR_CLKOUT_MASK)
+
+static const struct pci_device_id adv_pci_tbl[] = {
+	/* PCI BAR 0 iomem 0x400 bytes per port 32-bit word for each reg */
+	{ PCI_VDEVICE(ADVANTECH, 0xc201) },
+	{ PCI_VDEVICE(ADVANTECH, 0xc202) },
+	{ PCI_VDEVICE(ADVANTECH, 0xc204) },
+	{ PCI_VDEVICE(ADVANTECH, 0xc301) },
+	{ PCI_VDEVICE(ADVANTECH, 0xc302) }, /* MIOe-3680 */
+	{ PCI_VDEVICE(ADVANTECH, 0xc304) },
+	{ 0, }
+};
+MODULE_DEVICE_TABLE(pci, adv_pci_tbl);
+
+static void adv_hist_add(struct adv_hist __percpu *hist, u64 ns)
+{
+	this_cpu_inc(hist->bucket[min(fls64(ns), ADV_HIST_BUCKETS - 1)]);
+}
+
+static u64 adv_hist_sum(struct adv_hist __percpu *hist, int bucket)
+{
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(hist, cpu)->bucket[bucket];
+
+	return sum;
+}
+
+static void adv_hist_reset(struct adv_hist __percpu *hist)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(hist, cpu), 0, sizeof(struct adv_hist));
+}
+
+static void __adv_pmu_count(int card, int port, enum adv_pmu_event ev,
+			    u64 n)
+{
+	struct adv_pmu_events *events;
+	struct perf_event *event;
+	u64 config;
+
+	/* Register accesses also come from process context, the events
+	 * are those of the CPU counting them
+	 */
+	events = get_cpu_ptr(adv_pmu_events);
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(event, &events->head[ev], hlist_entry) {
+		if (event->hw.state & PERF_HES_STOPPED)
+			continue;
+		config = event->attr.config;
+		if (ADV_PMU_CARDS(config) &&
+		    (card >= 8 || !(ADV_PMU_CARDS(config) & BIT(card))))
+			continue;
+		if (ADV_PMU_PORTS(config) &&
+		    (port < 0 || !(ADV_PMU_PORTS(config) & BIT(port))))
+			continue;
+		local64_add(n, &event->count);
+	}
+	rcu_read_unlock();
+	put_cpu_ptr(adv_pmu_events);
+}
+
+/* Port -1 counts card level events */
+static inline void adv_pmu_count(const struct adv_pci_card *card, int port,
+				 enum adv_pmu_event ev, u64 n)
+{
+	if (static_key_false(&adv_pmu_active))
+		__adv_pmu_count(card->id, port, ev, n);
+}
+
+static u8 adv_mmio_read(const struct sja1000_priv *priv, int reg)
+{
+	struct adv_pci_port *port = priv->priv;
+
+	adv_pmu_count(port->card, port->index, ADV_PMU_MMIO_READ, 1);
+
+	return readb(priv->reg_base + 4 * reg);
+}
+
+static void adv_mmio_write(const struct sja1000_priv *priv, int reg, u8 val)
+{
+	struct adv_pci_port *port = priv->priv;
+
+	writeb(val, priv->reg_base + 4 * reg);
+	adv_pmu_count(port->card, port->index, ADV_PMU_MMIO_WRITE, 1);
+}
+
+/* True in the card handler servicing the port, not on other CPUs that
+ * may transmit on it meanwhile.
+ */
+static inline bool adv_in_isr(const struct adv_pci_port *port)
+{
+	return port->in_isr && port->isr_cpu == raw_smp_processor_id();
+}
+
+/* Receive hooks */
+
+static void adv_redirect_tasklet(unsigned long data)
+{
+	struct adv_pci_card *card = (struct adv_pci_card *)data;
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&card->redirect_q)))
+		dev_queue_xmit(skb);
+}
+
+#ifdef ADV_RX_BPF
+static void adv_rx_redirect(struct adv_pci_port *port, int index,
+			    const struct can_frame *cf)
+{
+	struct adv_pci_card *card = port->card;
+	struct net_device *dev;
+	struct can_frame *ncf;
+	struct sk_buff *skb;
+
+	if (index >= card->nr_ports)
+		goto err;
+	dev = card->port[index].dev;
+	if (!dev || !netif_running(dev))
+		goto err;
+
+	skb = alloc_can_skb(dev, &ncf);
+	if (!skb)
+		goto err;
+	*ncf = *cf;
+
+	skb_queue_tail(&card->redirect_q, skb);
+	tasklet_schedule(&card->redirect_tasklet);
+	port->bpf_redirect++;
+	return;
+
+err:
+	port->bpf_redirect_err++;
+}
+
+static int adv_rx_bpf(struct adv_pci_port *port, const struct can_frame *cf,
+		      u64 ts)
+{
+	struct adv_can_rx_ctx *ctx;
+	struct bpf_prog *prog;
+	u32 ret;
+
+	rcu_read_lock();
+	prog = rcu_dereference(port->rx_prog);
+	if (!prog) {
+		rcu_read_unlock();
+		return ADV_RX_PASS;
+	}
+
+	ctx = (struct adv_can_rx_ctx *)port->rx_prog_skb->data;
+	ctx->timestamp_ns = cpu_to_be64(ts);
+	ctx->port = port->index;
+	if (cf->can_id & CAN_EFF_FLAG) {
+		ctx->can_id = cpu_to_be32(cf->can_id & CAN_EFF_MASK);
+		ctx->flags = ADV_CAN_F_EFF;
+	} else {
+		ctx->can_id = cpu_to_be32(cf->can_id & CAN_SFF_MASK);
+		ctx->flags = 0;
+	}
+	if (cf->can_id & CAN_RTR_FLAG)
+		ctx->flags |= ADV_CAN_F_RTR;
+	ctx->dlc = cf->can_dlc;
+	memcpy(ctx->data, cf->data, sizeof(ctx->data));
+
+	ret = BPF_PROG_RUN(prog, port->rx_prog_skb);
+	rcu_read_unlock();
+
+	if (ret == ADV_RX_DROP) {
+		port->bpf_drop++;
+		return ADV_RX_DROP;
+	}
+	if ((ret & ~0xffU) == ADV_RX_REDIRECT(0)) {
+		adv_rx_redirect(port, ret & 0xff, cf);
+		return ADV_RX_DROP;
+	}
+
+	port->bpf_pass++;
+	return ADV_RX_PASS;
+}
+#endif
+
+static void adv_alc_add(struct adv_pci_port *port, canid_t winner)
+{
+	struct adv_alc_pair *p;
+	int i;
+
+	for (i = 0; i < ADV_ALC_PAIRS; i++) {
+		p = &port->alc[i];
+		if (!p->count) {
+			p->tx_id = port->alc_tx_id;
+			p->winner = winner;
+			p->bit_min = port->alc_pos;
+			p->bit_max = port->alc_pos;
+			break;
+		}
+		if (p->tx_id == port->alc_tx_id && p->winner == winner)
+			break;
+	}
+	if (i == ADV_ALC_PAIRS) {
+		port->alc_overflow++;
+		return;
+	}
+
+	p->count++;
+	p->bit_min = min(p->bit_min, port->alc_pos);
+	p->bit_max = max(p->bit_max, port->alc_pos);
+}
+
+/* The arbitration lost capture register was read */
+static void adv_alc_lost(struct adv_pci_port *port, u8 alc)
+{
+	if (port->alc_pending)
+		adv_alc_add(port, ADV_ALC_UNKNOWN);
+
+	port->alc_bit[alc & 0x1f]++;
+	port->alc_tx_id = port->tx_id;
+	port->alc_pos = alc & 0x1f;
+	port->alc_pending = true;
+}
+
+/* The controller receives the frame that won, and it completes before
+ * ours is retried, so the next frame received is the probable winner.
+ * When the handler runs only after the winner completed, frames that
+ * were already waiting are taken for it.
+ */
+static void adv_alc_winner(struct adv_pci_port *port,
+			   const struct can_frame *cf)
+{
+	port->alc_pending = false;
+	adv_alc_add(port, cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK));
+}
+
+/* A frame is dropped when its identifier matches rules but its payload
+ * matches none of them. Frames no rule covers pass.
+ */
+static int adv_rx_filter(struct adv_pci_port *port, const struct can_frame *cf)
+{
+	canid_t id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	const struct adv_rx_filters *f;
+	const struct adv_rx_filter *r;
+	bool covered = false;
+	int ret = ADV_RX_PASS;
+	unsigned int i;
+	u64 data;
+
+	rcu_read_lock();
+	f = rcu_dereference(port->rx_filters);
+	if (!f)
+		goto out;
+
+	memcpy(&data, cf->data, sizeof(data));
+	for (i = 0; i < f->count; i++) {
+		r = &f->rule[i];
+		if ((id ^ r->id) & r->id_mask)
+			continue;
+		if (!((data ^ r->data) & r->data_mask))
+			goto pass;
+		covered = true;
+	}
+	if (covered) {
+		port->filter_drop++;
+		ret = ADV_RX_DROP;
+		goto out;
+	}
+pass:
+	port->filter_pass++;
+out:
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* Updates the latest value of a subscribed identifier */
+static int adv_lv_update(struct adv_pci_port *port, const struct can_frame *cf,
+			 u64 ts)
+{
+	canid_t id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	struct adv_can_lv_entry *e;
+	struct adv_lv_sub *sub;
+	int ret = ADV_RX_PASS;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(port->lv_subs, sub, node, id) {
+		if (sub->id != id)
+			continue;
+
+		e = &port->lv_table->entry[sub->index];
+		e->seq++;
+		smp_wmb();
+		e->timestamp_ns = ts;
+		e->count++;
+		e->flags = 0;
+		if (cf->can_id & CAN_EFF_FLAG)
+			e->flags |= ADV_CAN_F_EFF;
+		if (cf->can_id & CAN_RTR_FLAG)
+			e->flags |= ADV_CAN_F_RTR;
+		e->dlc = cf->can_dlc;
+		memcpy(e->data, cf->data, sizeof(e->data));
+		smp_wmb();
+		e->seq++;
+
+		if (sub->only)
+			ret = ADV_RX_DROP;
+		break;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static bool adv_rx_high(struct adv_pci_port *port, const struct can_frame *cf)
+{
+	canid_t id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	const struct adv_rx_prio *p;
+	bool high = false;
+	unsigned int i;
+
+	rcu_read_lock();
+	p = rcu_dereference(port->rx_prio);
+	for (i = 0; p && i < p->count; i++) {
+		if (id >= p->range[i].first && id <= p->range[i].last) {
+			high = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return high;
+}
+
+/* netif_rx() queues frames to the backlog of the CPU, up to
+ * netdev_max_backlog frames. Over the watermark only identifiers in the
+ * priority ranges are passed, so they have the rest of the backlog.
+ */
+static bool adv_rx_overload(struct adv_pci_port *port, bool high)
+{
+	struct softnet_data *sd = this_cpu_ptr(&softnet_data);
+
+	if (skb_queue_len(&sd->input_pkt_queue) * 100 <
+	    (unsigned int)netdev_max_backlog * port->rx_watermark)
+		return false;
+
+	if (high) {
+		port->prio_high_kept++;
+		return false;
+	}
+
+	port->prio_low_dropped++;
+	return true;
+}
+
+/* The core hands a frame to netif_rx() right after it releases the
+ * receive buffer, then reads SR for the next one. A drop counted by the
+ * backlog in between is charged to the class of that frame.
+ */
+static void adv_rx_backlog_drops(struct adv_pci_port *port)
+{
+	if (port->rx_sd->dropped != port->rx_sd_dropped) {
+		if (port->rx_high)
+			port->prio_high_backlog_dropped++;
+		else
+			port->prio_low_backlog_dropped++;
+	}
+	port->rx_sd = NULL;
+}
+
+/* High priority frames skip the backlog. They are handed to the stack
+ * from a high priority tasklet, which runs before the backlog is
+ * processed.
+ */
+static void adv_rx_fast(struct adv_pci_port *port, const struct can_frame *cf)
+{
+	struct net_device *dev = port->dev;
+	struct can_frame *ncf;
+	struct sk_buff *skb;
+
+	skb = alloc_can_skb(dev, &ncf);
+	if (!skb) {
+		dev->stats.rx_dropped++;
+		return;
+	}
+	*ncf = *cf;
+
+	dev->stats.rx_packets++;
+	dev->stats.rx_bytes += cf->can_dlc;
+	port->fast_lane++;
+
+	skb_queue_tail(&port->fast_q, skb);
+	tasklet_hi_schedule(&port->fast_tasklet);
+}
+
+static void adv_rx_fast_tasklet(unsigned long data)
+{
+	struct adv_pci_port *port = (struct adv_pci_port *)data;
+	struct sk_buff *skb;
+
+	while ((skb = skb_dequeue(&port->fast_q)))
+		netif_receive_skb(skb);
+}
+
+static int adv_rx_callbacks(struct adv_pci_port *port,
+			    const struct can_frame *cf, u64 ts)
+{
+	struct adv_can_rx_hook *h;
+	int ret = ADV_RX_PASS;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(h, &port->rx_cbs, list) {
+		if ((cf->can_id ^ h->id) & h->mask)
+			continue;
+		if (h->fn(h->data, cf, ts))
+			ret = ADV_RX_DROP;
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+/* Send deferred flow control frames in order while the transmit buffer
+ * takes them. Frames refused for another reason than a busy buffer are
+ * dropped. Called with fc_lock held.
+ */
+static void __adv_isotp_flush(struct adv_pci_port *port)
+{
+	int err;
+
+	while (port->fc_count) {
+		err = adv_can_xmit(port->dev, &port->fc_ring[port->fc_head]);
+		if (err == -EBUSY)
+			break;
+		if (!err)
+			port->fc_sent++;
+		port->fc_head = (port->fc_head + 1) % ADV_ISOTP_FC_PENDING;
+		port->fc_count--;
+	}
+}
+
+static void adv_isotp_flush(struct adv_pci_port *port)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&port->fc_lock, flags);
+	__adv_isotp_flush(port);
+	spin_unlock_irqrestore(&port->fc_lock, flags);
+}
+
+/* Answers an ISO-TP first frame with flow control from the interrupt
+ * handler. When the transmit buffer is busy or the frame is not yet due,
+ * it is queued behind earlier deferred ones and sent after the next
+ * interrupt of the port or from the pace timer.
+ */
+static void adv_isotp_first_frame(struct adv_pci_port *port,
+				  const struct can_frame *cf)
+{
+	canid_t id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	const struct adv_isotp_fc *f;
+	unsigned long flags;
+	unsigned int i;
+	int err = -EBUSY;
+
+	if (cf->can_dlc < 2 || (cf->data[0] & 0xf0) != 0x10 ||
+	    (cf->can_id & CAN_RTR_FLAG))
+		return;
+
+	rcu_read_lock();
+	f = rcu_dereference(port->isotp_fc);
+	for (i = 0; f && i < f->count; i++) {
+		if (f->resp[i].rx_id != id)
+			continue;
+
+		spin_lock_irqsave(&port->fc_lock, flags);
+		__adv_isotp_flush(port);
+		if (!port->fc_count)
+			err = adv_can_xmit(port->dev, &f->resp[i].fc);
+		if (!err) {
+			port->fc_sent++;
+		} else if (err == -EBUSY &&
+			   port->fc_count == ADV_ISOTP_FC_PENDING) {
+			port->fc_overflow++;
+		} else if (err == -EBUSY) {
+			port->fc_ring[(port->fc_head + port->fc_count) %
+				      ADV_ISOTP_FC_PENDING] = f->resp[i].fc;
+			port->fc_count++;
+			port->fc_deferred++;
+		}
+		spin_unlock_irqrestore(&port->fc_lock, flags);
+		break;
+	}
+	rcu_read_unlock();
+}
+
+/* Send the capture packet being filled. Called under cap_lock. */
+static void adv_cap_flush(struct adv_pci_card *card)
+{
+	struct sk_buff *skb = card->cap_skb;
+
+	if (!skb)
+		return;
+
+	card->cap_skb = NULL;
+	card->cap_count = 0;
+	card->cap_dev->stats.rx_packets++;
+	card->cap_dev->stats.rx_bytes += skb->len;
+	netif_rx(skb);
+}
+
+static enum hrtimer_restart adv_cap_timer(struct hrtimer *timer)
+{
+	struct adv_pci_card *card = container_of(timer, struct adv_pci_card,
+						 cap_timer);
+	unsigned long flags;
+
+	spin_lock_irqsave(&card->cap_lock, flags);
+	adv_cap_flush(card);
+	spin_unlock_irqrestore(&card->cap_lock, flags);
+
+	return HRTIMER_NORESTART;
+}
+
+static void adv_cap_add(struct adv_pci_port *port, const struct can_frame *cf,
+			u64 ts)
+{
+	struct adv_pci_card *card = port->card;
+	struct adv_can_capture_rec *rec;
+	struct sk_buff *skb;
+	unsigned long flags;
+
+	spin_lock_irqsave(&card->cap_lock, flags);
+
+	skb = card->cap_skb;
+	if (!skb) {
+		skb = netdev_alloc_skb(card->cap_dev,
+				       capture_batch * sizeof(*rec));
+		if (!skb) {
+			card->cap_dev->stats.rx_dropped++;
+			goto out;
+		}
+		skb->protocol = htons(ADV_CAN_CAPTURE_PROTO);
+		skb->pkt_type = PACKET_HOST;
+		skb->ip_summed = CHECKSUM_UNNECESSARY;
+		skb_reset_mac_header(skb);
+		skb_reset_network_header(skb);
+		skb_reset_transport_header(skb);
+		card->cap_skb = skb;
+		hrtimer_start(&card->cap_timer,
+			      ns_to_ktime((u64)capture_timeout_us *
+					  NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	}
+
+	rec = (struct adv_can_capture_rec *)skb_put(skb, sizeof(*rec));
+	memset(rec, 0, sizeof(*rec));
+	rec->timestamp_ns = ts;
+	rec->can_id = cf->can_id;
+	rec->port = port->index;
+	rec->dlc = cf->can_dlc;
+	memcpy(rec->data, cf->data, sizeof(rec->data));
+
+	if (++card->cap_count >= capture_batch) {
+		hrtimer_try_to_cancel(&card->cap_timer);
+		adv_cap_flush(card);
+	}
+out:
+	spin_unlock_irqrestore(&card->cap_lock, flags);
+}
+
+static bool adv_test_rx(struct adv_pci_port *port, const struct can_frame *cf,
+			u64 ts)
+{
+	struct adv_test *t = READ_ONCE(port->test);
+
+	if (!t || cf->can_id != t->id)
+		return false;
+
+	t->rx = *cf;
+	t->ns = ts;
+	complete(&t->done);
+
+	return true;
+}
+
+/* Returns ADV_RX_PASS to leave the frame to the core, otherwise the
+ * frame was consumed.
+ */
+static int adv_rx_hooks(struct adv_pci_port *port, const struct can_frame *cf,
+			u64 ts)
+{
+	bool high = false;
+
+	if (port->test && adv_test_rx(port, cf, ts))
+		return ADV_RX_DROP;
+
+	if (port->alc_pending)
+		adv_alc_winner(port, cf);
+
+	/* Capture sees all received frames, also those dropped below */
+	if (port->card->cap_running)
+		adv_cap_add(port, cf, ts);
+
+	if (!list_empty(&port->rx_cbs) &&
+	    adv_rx_callbacks(port, cf, ts) != ADV_RX_PASS)
+		return ADV_RX_DROP;
+
+	if (adv_rx_filter(port, cf) != ADV_RX_PASS)
+		return ADV_RX_DROP;
+
+	/* The table keeps the latest values also under overload */
+	if (port->lv_table && port->lv_table->nr_entries &&
+	    adv_lv_update(port, cf, ts) != ADV_RX_PASS)
+		return ADV_RX_DROP;
+
+	if (port->rx_watermark || port->rx_fast_lane)
+		high = adv_rx_high(port, cf);
+	if (port->rx_watermark && adv_rx_overload(port, high))
+		return ADV_RX_DROP;
+
+#ifdef ADV_RX_BPF
+	if (adv_rx_bpf(port, cf, ts) != ADV_RX_PASS)
+		return ADV_RX_DROP;
+#endif
+
+	/* Only first frames that reach the host are answered */
+	if (rcu_access_pointer(port->isotp_fc))
+		adv_isotp_first_frame(port, cf);
+
+	if (port->rx_fast_lane && high) {
+		adv_rx_fast(port, cf);
+		return ADV_RX_DROP;
+	}
+
+	port->rx_high = high;
+	return ADV_RX_PASS;
+}
+
+static void adv_rx_update_hooks(struct adv_pci_port *port)
+{
+	bool hooks = rcu_access_pointer(port->rx_filters) != NULL;
+
+	hooks |= port->lv_table && port->lv_table->nr_entries;
+	hooks |= port->rx_watermark != 0;
+	hooks |= port->rx_fast_lane;
+	hooks |= !list_empty(&port->rx_cbs);
+	hooks |= rcu_access_pointer(port->isotp_fc) != NULL;
+	hooks |= port->card->cap_running;
+	hooks |= port->test != NULL;
+
+#ifdef ADV_RX_BPF
+	hooks |= rcu_access_pointer(port->rx_prog) != NULL;
+#endif
+
+	port->rx_hooks = hooks;
+}
+
+/* Read the frame in the receive buffer into the cache, reading the same
+ * registers the core will read.
+ */
+static void adv_rx_fetch(struct adv_pci_port *port,
+			 const struct sja1000_priv *priv, struct can_frame *cf)
+{
+	u8 *buf = port->rx_cache;
+	u8 fi, len, n, i;
+	canid_t id;
+
+	fi = adv_mmio_read(priv, SJA1000_FI);
+	buf[0] = fi;
+	n = (fi & SJA1000_FI_FF) ? 4 : 2;
+	for (i = 1; i <= n; i++)
+		buf[i] = adv_mmio_read(priv, SJA1000_FI + i);
+
+	memset(cf, 0, sizeof(*cf));
+	if (fi & SJA1000_FI_FF)
+		id = (buf[1] << 21) | (buf[2] << 13) | (buf[3] << 5) |
+			(buf[4] >> 3) | CAN_EFF_FLAG;
+	else
+		id = (buf[1] << 3) | (buf[2] >> 5);
+
+	cf->can_dlc = get_can_dlc(fi & 0x0F);
+	len = cf->can_dlc;
+	if (fi & SJA1000_FI_RTR) {
+		id |= CAN_RTR_FLAG;
+		len = 0;
+	}
+	for (i = 0; i < len; i++) {
+		buf[n + 1 + i] = adv_mmio_read(priv, SJA1000_FI + n + 1 + i);
+		cf->data[i] = buf[n + 1 + i];
+	}
+	cf->can_id = id;
+
+	port->rx_cache_len = n + 1 + len;
+}
+
+/* The interrupt thread moves on to the next port after the budget, the
+ * receive interrupt brings it back.
+ */
+static bool adv_rx_budget_spent(const struct adv_pci_port *port)
+{
+	return irq_thread && port->irq_frames >= irq_thread_budget;
+}
+
+/* RX delivery latency ends when the receive buffer is released, by the
+ * core or by the hooks consuming the frame.
+ */
+static void adv_rx_released(struct adv_pci_port *port)
+{
+	u64 ns = local_clock() - port->irq_entry;
+
+	port->rx_cache_len = 0;
+	adv_hist_add(port->rx_hist, ns);
+	adv_hist_add(port->card->rx_hist, ns);
+	adv_pmu_count(port->card, port->index, ADV_PMU_RX_FRAME, 1);
+	port->irq_frames++;
+}
+
+/* Called on status register reads in the handler. Frames consumed by the
+ * hooks are released here, so the core only sees frames to deliver. The
+ * frame left in the cache is passed to the core on this pass, so none is
+ * fetched once the budget is spent.
+ */
+static u8 adv_rx_peek(struct adv_pci_port *port,
+		      const struct sja1000_priv *priv, u8 sr)
+{
+	struct sja1000_priv *rw = netdev_priv(port->dev);
+	struct can_frame cf;
+	unsigned long flags;
+
+	while ((sr & SR_RBS) && !port->rx_cache_len &&
+	       !adv_rx_budget_spent(port)) {
+		adv_rx_fetch(port, priv, &cf);
+		if (adv_rx_hooks(port, &cf, ktime_get_ns()) == ADV_RX_PASS)
+			break;
+
+		/* As sja1000_write_cmdreg() does */
+		spin_lock_irqsave(&rw->cmdreg_lock, flags);
+		adv_mmio_write(priv, SJA1000_CMR, CMD_RRB);
+		sr = adv_mmio_read(priv, SJA1000_SR);
+		spin_unlock_irqrestore(&rw->cmdreg_lock, flags);
+		adv_rx_released(port);
+	}
+
+	return sr;
+}
+
+/* Complete the BQL accounting of the frame when the core sees it sent */
+static void adv_tx_done(struct adv_pci_port *port, u8 ir)
+{
+	if ((ir & IRQ_TI) && port->tx_bql && adv_in_isr(port)) {
+		port->tx_bql = false;
+		netdev_completed_queue(port->dev, 1, port->tx_bql_bytes);
+	}
+}
+
+static u8 adv_ir_take(struct adv_pci_port *port)
+{
+	unsigned long flags;
+	u8 ir;
+
+	if (!irq_thread) {
+		port->ir_stashed = false;
+		return port->ir_pending;
+	}
+
+	spin_lock_irqsave(&port->ir_lock, flags);
+	ir = port->ir_pending;
+	port->ir_pending = 0;
+	port->ir_stashed = false;
+	spin_unlock_irqrestore(&port->ir_lock, flags);
+
+	return ir;
+}
+
+/* The core drains the receive buffer before it reads ALC for an
+ * arbitration loss on the same interrupt, which would take the winning
+ * frame past unseen. So ALC is read when the loss shows in IR.
+ */
+static void adv_alc_early(struct adv_pci_port *port,
+			  const struct sja1000_priv *priv, u8 ir)
+{
+	if (!(ir & IRQ_ALI) || !adv_in_isr(port))
+		return;
+
+	adv_alc_lost(port, adv_mmio_read(priv, SJA1000_ALC));
+	port->alc_read = true;
+}
+
+static u8 adv_read_reg(const struct sja1000_priv *priv, int reg)
+{
+	struct adv_pci_port *port = priv->priv;
+	u8 val;
+
+	if (reg == SJA1000_IER)
+		return port->ier;
+	if (reg == SJA1000_IR && port->ir_stashed) {
+		val = adv_ir_take(port);
+		adv_tx_done(port, val);
+		adv_alc_early(port, priv, val);
+		return val;
+	}
+	if (port->rx_cache_len && reg >= SJA1000_FI &&
+	    reg < SJA1000_FI + port->rx_cache_len && adv_in_isr(port))
+		return port->rx_cache[reg - SJA1000_FI];
+
+	val = adv_mmio_read(priv, reg);
+
+	if (reg == SJA1000_IR) {
+		adv_tx_done(port, val);
+		adv_alc_early(port, priv, val);
+	}
+
+	/* The core reads the capture registers on the error interrupts */
+	if (reg == SJA1000_ECC && adv_in_isr(port)) {
+		port->ecc_type[(val & ECC_MASK) >> ECC_ERR]++;
+		port->ecc_dir[!!(val & ECC_DIR)]++;
+		port->ecc_seg[val & ECC_SEG]++;
+	}
+	if (reg == SJA1000_ALC && adv_in_isr(port)) {
+		if (port->alc_read)
+			port->alc_read = false;
+		else
+			adv_alc_lost(port, val);
+	}
+
+	if (reg == SJA1000_SR && port->rx_sd && adv_in_isr(port))
+		adv_rx_backlog_drops(port);
+	if (reg == SJA1000_SR && (port->rx_hooks || port->alc_pending) &&
+	    adv_in_isr(port))
+		val = adv_rx_peek(port, priv, val);
+
+	/* After the peek, which stops at the budget itself */
+	if (reg == SJA1000_SR && adv_in_isr(port) && adv_rx_budget_spent(port))
+		val &= ~SR_RBS;
+
+	return val;
+}
+
+static void adv_write_reg(const struct sja1000_priv *priv, int reg, u8 val)
+{
+	struct adv_pci_port *port = priv->priv;
+
+	adv_mmio_write(priv, reg, val);
+
+	if (reg == SJA1000_IER)
+		port->ier = val;
+
+	/* The core releases the receive buffer right before it hands the
+	 * skb to netif_rx(), so that is where RX delivery latency ends.
+	 */
+	if (reg == SJA1000_CMR && (val & CMD_RRB) && adv_in_isr(port)) {
+		adv_rx_released(port);
+		if (port->rx_watermark || port->rx_fast_lane) {
+			port->rx_sd = this_cpu_ptr(&softnet_data);
+			port->rx_sd_dropped = port->rx_sd->dropped;
+		}
+	}
+}
+
+/* The packet generator sleeps while the transmit buffer is busy. Called
+ * wherever the queue may have been woken.
+ */
+static void adv_pktgen_kick(struct adv_pci_port *port)
+{
+	if (port->pktgen.task && !netif_queue_stopped(port->dev))
+		wake_up(&port->pktgen.tx_wait);
+}
+
+/* Runs sja1000_interrupt() for a port with IR stashed and keeps the
+ * statistics. entry is the time the card interrupt came.
+ */
+static irqreturn_t adv_port_service(struct adv_pci_port *port, int irq,
+				    u64 entry)
+{
+	struct adv_pci_card *card = port->card;
+	irqreturn_t ret = IRQ_NONE;
+	unsigned long overruns;
+	u64 start;
+
+	port->irq_entry = entry;
+	port->irq_frames = 0;
+	port->isr_cpu = raw_smp_processor_id();
+	port->in_isr = true;
+	overruns = port->dev->stats.rx_over_errors;
+	start = local_clock();
+	if (sja1000_interrupt(irq, port->dev) == IRQ_HANDLED) {
+		adv_hist_add(port->isr_hist, local_clock() - start);
+		adv_pmu_count(card, port->index, ADV_PMU_IRQ, 1);
+		port->irq_count++;
+		ret = IRQ_HANDLED;
+	}
+	port->in_isr = false;
+	port->rx_cache_len = 0;
+	port->rx_sd = NULL;
+	adv_pktgen_kick(port);
+
+	if (port->fc_count)
+		adv_isotp_flush(port);
+
+	if (port->dev->stats.rx_over_errors != overruns)
+		adv_pmu_count(card, port->index, ADV_PMU_OVERRUN,
+			      port->dev->stats.rx_over_errors - overruns);
+
+	port->irq_frames_max = max(port->irq_frames_max, port->irq_frames);
+
+	return ret;
+}
+
+static void adv_card_irq_done(struct adv_pci_card *card, u64 entry,
+			      unsigned int frames)
+{
+	u64 ns = local_clock() - entry;
+
+	adv_hist_add(card->isr_hist, ns);
+	card->isr_ns_max = max(card->isr_ns_max, ns);
+	card->irq_frames_max = max(card->irq_frames_max, frames);
+}
+
+/* With irq_thread the frames are drained in the thread, timed apart from
+ * the hard handler
+ */
+static void adv_card_thread_done(struct adv_pci_card *card, u64 entry,
+				 unsigned int frames)
+{
+	u64 ns = local_clock() - entry;
+
+	adv_hist_add(card->thread_hist, ns);
+	card->thread_ns_max = max(card->thread_ns_max, ns);
+	card->irq_frames_max = max(card->irq_frames_max, frames);
+}
+
+static bool adv_port_active(struct adv_pci_port *port)
+{
+	return port->dev && port->ier != IRQ_OFF && netif_running(port->dev);
+}
+
+/* All ports of the card share the PCI interrupt, so one handler serves
+ * them all and keeps the timing statistics.
+ *
+ * The line is often shared with other devices. Only open ports with
+ * interrupts enabled are looked at, and a single IR read per port
+ * decides whether sja1000_interrupt() needs to run, so an interrupt of
+ * another device costs one bus read per open port.
+ */
+static irqreturn_t adv_interrupt(int irq, void *dev_id)
+{
+	struct adv_pci_card *card = dev_id;
+	struct adv_pci_port *port;
+	struct sja1000_priv *priv;
+	irqreturn_t ret = IRQ_NONE;
+	unsigned int frames = 0;
+	u64 entry;
+	u8 ir;
+	int i;
+
+	entry = local_clock();
+
+	for (i = 0; i < card->nr_ports; i++) {
+		port = &card->port[i];
+		if (!adv_port_active(port))
+			continue;
+
+		priv = netdev_priv(port->dev);
+		ir = priv->read_reg(priv, SJA1000_IR);
+		if (!ir)
+			continue;
+		port->ir_pending = ir;
+		port->ir_stashed = true;
+
+		if (adv_port_service(port, irq, entry) == IRQ_HANDLED)
+			ret = IRQ_HANDLED;
+		port->ir_stashed = false;
+		frames += port->irq_frames;
+	}
+
+	adv_card_irq_done(card, entry, frames);
+	if (ret == IRQ_NONE) {
+		card->foreign_irqs++;
+		adv_pmu_count(card, -1, ADV_PMU_SPURIOUS_IRQ, 1);
+	}
+
+	return ret;
+}
+
+/* Interrupt thread
+ *
+ * With irq_thread set, one thread serves the ports of all cards. The hard
+ * handler only collects IR and masks the receive interrupt, which stays
+ * asserted while the receive FIFO holds frames. The thread then serves
+ * the ports in turn, at most irq_thread_budget frames from each, and
+ * unmasks the receive interrupt, which comes back for ports with frames
+ * left.
+ */
+static irqreturn_t adv_interrupt_hard(int irq, void *dev_id)
+{
+	struct adv_pci_card *card = dev_id;
+	struct adv_pci_port *port;
+	struct sja1000_priv *priv;
+	irqreturn_t ret = IRQ_NONE;
+	u64 now = local_clock();
+	u8 ir;
+	int i;
+
+	for (i = 0; i < card->nr_ports; i++) {
+		port = &card->port[i];
+		if (!adv_port_active(port))
+			continue;
+
+		priv = netdev_priv(port->dev);
+		spin_lock(&port->ir_lock);
+		ir = adv_mmio_read(priv, SJA1000_IR);
+		if (ir) {
+			if (!port->ir_stashed)
+				port->ir_time = now;
+			port->ir_pending |= ir;
+			port->ir_stashed = true;
+			adv_mmio_write(priv, SJA1000_IER, port->ier & ~IRQ_RI);
+			ret = IRQ_HANDLED;
+		}
+		spin_unlock(&port->ir_lock);
+	}
+
+	if (ret == IRQ_HANDLED) {
+		atomic_set(&adv_irq_work, 1);
+		wake_up_process(adv_irq_task);
+	} else {
+		card->foreign_irqs++;
+		adv_pmu_count(card, -1, ADV_PMU_SPURIOUS_IRQ, 1);
+	}
+	adv_card_irq_done(card, now, 0);
+
+	return ret;
+}
+
+static void adv_irq_thread_pass(void)
+{
+	struct adv_pci_card *card;
+	struct adv_pci_port *port;
+	struct sja1000_priv *priv;
+	unsigned long flags;
+	unsigned int frames;
+	u64 entry;
+	int i;
+
+	/* The core expects to run in interrupt context */
+	local_bh_disable();
+	rcu_read_lock();
+	list_for_each_entry_rcu(card, &adv_cards, list) {
+		entry = local_clock();
+		frames = 0;
+		for (i = 0; i < card->nr_ports; i++) {
+			port = &card->port[i];
+			if (!port->ir_stashed || !adv_port_active(port))
+				continue;
+
+			adv_port_service(port, card->pdev->irq, port->ir_time);
+			frames += port->irq_frames;
+
+			priv = netdev_priv(port->dev);
+			spin_lock_irqsave(&port->ir_lock, flags);
+			adv_mmio_write(priv, SJA1000_IER, port->ier);
+			spin_unlock_irqrestore(&port->ir_lock, flags);
+		}
+		if (frames)
+			adv_card_thread_done(card, entry, frames);
+	}
+	rcu_read_unlock();
+	local_bh_enable();
+}
+
+static int adv_irq_thread(void *data)
+{
+	struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO / 2 };
+
+	sched_setscheduler(current, SCHED_FIFO, &param);
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		if (!atomic_xchg(&adv_irq_work, 0)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		adv_irq_thread_pass();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int adv_irq_thread_start(void)
+{
+	struct task_struct *task;
+
+	if (irq_thread_cpu >= 0 && !cpu_online(irq_thread_cpu))
+		return -EINVAL;
+
+	task = kthread_create(adv_irq_thread, NULL, "adv_can_irq");
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+	if (irq_thread_cpu >= 0)
+		kthread_bind(task, irq_thread_cpu);
+
+	adv_irq_task = task;
+	wake_up_process(task);
+
+	return 0;
+}
+
+/* Frame length on the bus */
+
+struct adv_bitstream {
+	unsigned int bits;
+	u16 crc;
+	u8 last;
+	u8 run;
+};
+
+static void adv_bits_put(struct adv_bitstream *bs, u32 val, int n)
+{
+	u8 bit;
+
+	while (n--) {
+		bit = (val >> n) & 1;
+
+		if (bit ^ ((bs->crc >> 14) & 1))
+			bs->crc = ((bs->crc << 1) ^ 0x4599) & 0x7fff;
+		else
+			bs->crc = (bs->crc << 1) & 0x7fff;
+
+		bs->bits++;
+		if (bit == bs->last) {
+			if (++bs->run == 5) {
+				/* stuff bit of opposite value starts a run */
+				bs->bits++;
+				bs->last = !bit;
+				bs->run = 1;
+			}
+		} else {
+			bs->last = bit;
+			bs->run = 1;
+		}
+	}
+}
+
+/* Number of bits a frame occupies on the bus, including stuff bits and
+ * the interframe space.
+ */
+static unsigned int adv_can_frame_bits(const struct can_frame *cf)
+{
+	struct adv_bitstream bs = { .last = 1 };
+	canid_t id = cf->can_id;
+	u8 rtr = !!(id & CAN_RTR_FLAG);
+	int i, len;
+
+	adv_bits_put(&bs, 0, 1);				/* SOF */
+	if (id & CAN_EFF_FLAG) {
+		adv_bits_put(&bs, (id >> 18) & 0x7ff, 11);
+		adv_bits_put(&bs, 3, 2);			/* SRR, IDE */
+		adv_bits_put(&bs, id & 0x3ffff, 18);
+		adv_bits_put(&bs, rtr, 1);
+		adv_bits_put(&bs, 0, 2);			/* r1, r0 */
+	} else {
+		adv_bits_put(&bs, id & CAN_SFF_MASK, 11);
+		adv_bits_put(&bs, rtr, 1);
+		adv_bits_put(&bs, 0, 2);			/* IDE, r0 */
+	}
+	adv_bits_put(&bs, cf->can_dlc, 4);
+
+	len = rtr ? 0 : min_t(int, cf->can_dlc, CAN_MAX_DLEN);
+	for (i = 0; i < len; i++)
+		adv_bits_put(&bs, cf->data[i], 8);
+
+	adv_bits_put(&bs, bs.crc, 15);
+
+	/* CRC delimiter, ACK, ACK delimiter, EOF and intermission */
+	return bs.bits + 3 + 7 + 3;
+}
+
+static enum hrtimer_restart adv_tx_pace_timer(struct hrtimer *timer)
+{
+	struct adv_pci_port *port = container_of(timer, struct adv_pci_port,
+						 tx_pace_timer);
+
+	netif_wake_queue(port->dev);
+	if (port->fc_count)
+		adv_isotp_flush(port);
+	adv_pktgen_kick(port);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Each frame reserves its bus time scaled by the load limit. A frame
+ * that comes before the time reserved by the previous ones is requeued
+ * and the queue woken when it is due. The transmit interrupt may wake
+ * the queue earlier, in which case the frame is requeued again.
+ */
+static bool adv_tx_paced(struct adv_pci_port *port, struct net_device *dev)
+{
+	if (!port->tx_load_limit || port->tx_tat <= ktime_get_ns())
+		return false;
+
+	netif_stop_queue(dev);
+	hrtimer_start(&port->tx_pace_timer, ns_to_ktime(port->tx_tat),
+		      HRTIMER_MODE_ABS);
+
+	return true;
+}
+
+/* Reserve the bus time of a frame handed to the controller */
+static void adv_tx_pace_charge(struct adv_pci_port *port,
+			       struct net_device *dev,
+			       const struct can_frame *cf)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+	u32 bitrate = priv->can.bittiming.bitrate;
+
+	if (!port->tx_load_limit || !bitrate)
+		return;
+
+	port->tx_tat = ktime_get_ns() +
+		div_u64((u64)adv_can_frame_bits(cf) * NSEC_PER_SEC * 100,
+			bitrate * port->tx_load_limit);
+}
+
+/* Rate limits per identifier, as a generic cell rate algorithm: a frame
+ * conforms when it comes no earlier than its theoretical arrival time
+ * less the burst tolerance. Frames over the limit are dropped; holding
+ * them would stop the single queue and every other identifier with it.
+ * Returns true to drop the frame.
+ */
+static bool adv_tx_id_limit(struct adv_pci_port *port,
+			    const struct can_frame *cf)
+{
+	canid_t id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+	struct adv_tx_limit *l;
+	bool drop = false;
+	u64 now, tau;
+
+	if (!port->tx_limit_count)
+		return false;
+
+	rcu_read_lock();
+	hash_for_each_possible_rcu(port->tx_limits, l, node, id) {
+		if (l->id != id)
+			continue;
+
+		now = ktime_get_ns();
+		tau = l->interval_ns * (l->burst - 1);
+		if (l->tat <= now + tau) {
+			l->tat = max(l->tat, now) + l->interval_ns;
+			l->passed++;
+		} else {
+			l->dropped++;
+			drop = true;
+		}
+		break;
+	}
+	rcu_read_unlock();
+
+	return drop;
+}
+
+/* The core stops the queue for each frame and wakes it on the transmit
+ * interrupt, so a single frame is in flight. Byte queue limits account
+ * it, which shows in the byte_queue_limits of the queue.
+ *
+ * Pacing is decided first, as a requeued frame comes back here. The
+ * identifier limit is charged only for frames given to the core.
+ * adv_can_xmit() may have taken the buffer since the stack checked the
+ * queue, so it is checked again under tx_lock.
+ */
+static netdev_tx_t adv_start_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+	struct adv_pci_port *port = priv->priv;
+	struct can_frame *cf = (struct can_frame *)skb->data;
+	netdev_tx_t ret = NETDEV_TX_BUSY;
+	unsigned long flags;
+
+	if (can_dropped_invalid_skb(dev, skb))
+		return NETDEV_TX_OK;
+
+	spin_lock_irqsave(&port->tx_lock, flags);
+	if (netif_queue_stopped(dev))
+		goto out;
+
+	/* Held while the bitrate is switched */
+	if (port->tx_hold) {
+		netif_stop_queue(dev);
+		goto out;
+	}
+
+	if (adv_tx_paced(port, dev))
+		goto out;
+
+	if (adv_tx_id_limit(port, cf)) {
+		dev->stats.tx_dropped++;
+		kfree_skb(skb);
+		ret = NETDEV_TX_OK;
+		goto out;
+	}
+
+	adv_tx_pace_charge(port, dev, cf);
+	port->tx_id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+
+	/* Accounted before the core starts transmission, which may
+	 * complete on another CPU before it returns.
+	 */
+	port->tx_bql_bytes = skb->len;
+	netdev_sent_queue(dev, skb->len);
+	port->tx_bql = true;
+
+	ret = port->core_ops->ndo_start_xmit(skb, dev);
+out:
+	spin_unlock_irqrestore(&port->tx_lock, flags);
+
+	return ret;
+}
+
+/* Mode transitions
+ *
+ * The controller follows a MOD write within a few of its clock cycles,
+ * so the read that flushes the posted PCI write normally already shows
+ * the new mode. The core instead waits 10 us before each check and
+ * reads MOD also before writing it. Here MOD is read back every
+ * ADV_MOD_POLL_NS, the write repeated every ADV_MOD_RETRY reads, within
+ * the same 1 ms the core allows. Several ports of a card are switched
+ * together, so their waits overlap.
+ */
+#define ADV_MOD_POLL_NS		200
+#define ADV_MOD_RETRY		16
+#define ADV_MOD_TIMEOUT_NS	(1000 * NSEC_PER_USEC)
+
+/* Write mod[i] to MOD of port i for the ports in mask and wait for them.
+ * Returns the mask of ports not following.
+ */
+static unsigned int adv_ports_set_mode(struct adv_pci_card *card,
+				       unsigned int mask, const u8 *mod)
+{
+	unsigned int extra[ARRAY_SIZE(card->port)] = { 0 };
+	u64 done_ns[ARRAY_SIZE(card->port)];
+	unsigned int pending = mask, polls = 0;
+	struct adv_pci_port *port;
+	struct sja1000_priv *priv;
+	unsigned long flags;
+	u64 start;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < card->nr_ports; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		priv = netdev_priv(card->port[i].dev);
+		priv->write_reg(priv, SJA1000_MOD, mod[i]);
+	}
+
+	for (;;) {
+		for (i = 0; i < card->nr_ports; i++) {
+			if (!(pending & BIT(i)))
+				continue;
+			priv = netdev_priv(card->port[i].dev);
+			extra[i] += polls > 0;
+			if ((priv->read_reg(priv, SJA1000_MOD) & MOD_RM) !=
+			    (mod[i] & MOD_RM))
+				continue;
+
+			pending &= ~BIT(i);
+			done_ns[i] = ktime_get_ns() - start;
+		}
+		if (!pending || ktime_get_ns() - start > ADV_MOD_TIMEOUT_NS)
+			break;
+
+		ndelay(ADV_MOD_POLL_NS);
+		if (++polls % ADV_MOD_RETRY)
+			continue;
+		for (i = 0; i < card->nr_ports; i++) {
+			if (!(pending & BIT(i)))
+				continue;
+			priv = netdev_priv(card->port[i].dev);
+			priv->write_reg(priv, SJA1000_MOD, mod[i]);
+		}
+	}
+
+	for (i = 0; i < card->nr_ports; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		port = &card->port[i];
+		spin_lock_irqsave(&port->mode_lock, flags);
+		if (pending & BIT(i)) {
+			port->mode_timeouts++;
+		} else {
+			port->mode_switches++;
+			port->mode_ns_last = done_ns[i];
+			port->mode_ns_max = max(port->mode_ns_max, done_ns[i]);
+		}
+		port->mode_polls += extra[i];
+		spin_unlock_irqrestore(&port->mode_lock, flags);
+	}
+
+	return pending;
+}
+
+/* Write the mode register and wait for the controller to follow */
+static int adv_set_mode(struct sja1000_priv *priv, u8 mod)
+{
+	struct adv_pci_port *port = priv->priv;
+	u8 mods[ARRAY_SIZE(port->card->port)];
+
+	mods[port->index] = mod;
+	if (adv_ports_set_mode(port->card, BIT(port->index), mods))
+		return -ETIMEDOUT;
+
+	return 0;
+}
+
+/* Operating mode as the core sets it */
+static u8 adv_normal_mod(const struct sja1000_priv *priv)
+{
+	u8 mod = 0;
+
+	if (priv->can.ctrlmode & CAN_CTRLMODE_LISTENONLY)
+		mod |= MOD_LOM;
+	if (priv->can.ctrlmode & CAN_CTRLMODE_PRESUME_ACK)
+		mod |= MOD_STM;
+
+	return mod;
+}
+
+/* What sja1000_start() does before leaving reset mode. The core set the
+ * controller up in PeliCAN mode when registering the port and it is
+ * never changed, so CDR is not read to check that. Only a stalled
+ * controller is checked, see adv_ports_reinit().
+ */
+static void adv_start_prepare(struct adv_pci_port *port)
+{
+	struct sja1000_priv *priv = netdev_priv(port->dev);
+
+	port->tx_bql = false;
+	netdev_reset_queue(port->dev);
+	port->tx_tat = 0;
+
+	priv->write_reg(priv, SJA1000_TXERR, 0);
+	priv->write_reg(priv, SJA1000_RXERR, 0);
+	priv->write_reg(priv, SJA1000_EWL, port->ewl);
+	priv->read_reg(priv, SJA1000_ECC);
+	priv->read_reg(priv, SJA1000_IR);
+}
+
+static void adv_start_done(struct adv_pci_port *port)
+{
+	struct sja1000_priv *priv = netdev_priv(port->dev);
+
+	port->reinit_failed = false;
+	priv->can.state = CAN_STATE_ERROR_ACTIVE;
+	if (priv->can.ctrlmode & CAN_CTRLMODE_BERR_REPORTING)
+		priv->write_reg(priv, SJA1000_IER, IRQ_ALL);
+	else
+		priv->write_reg(priv, SJA1000_IER, IRQ_ALL & ~IRQ_BEI);
+}
+
+/* Replaces sja1000_start(). Ports are kept in reset mode while down. */
+static int adv_start(struct adv_pci_port *port)
+{
+	struct net_device *dev = port->dev;
+	struct sja1000_priv *priv = netdev_priv(dev);
+
+	if (priv->can.state != CAN_STATE_STOPPED) {
+		priv->write_reg(priv, SJA1000_IER, IRQ_OFF);
+		if (adv_set_mode(priv, MOD_RM)) {
+			netdev_err(dev, "setting reset mode failed\n");
+			return -ETIMEDOUT;
+		}
+		priv->can.state = CAN_STATE_STOPPED;
+	}
+
+	adv_start_prepare(port);
+	if (adv_set_mode(priv, adv_normal_mod(priv))) {
+		netdev_err(dev, "leaving reset mode failed\n");
+		return -ETIMEDOUT;
+	}
+	adv_start_done(port);
+
+	return 0;
+}
+
+/* Replaces sja1000_open(), the card handler serves the interrupt */
+static int adv_open(struct net_device *dev)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+	struct adv_pci_port *port = priv->priv;
+	int err;
+
+	err = open_candev(dev);
+	if (err)
+		return err;
+
+	err = adv_start(port);
+	if (err) {
+		close_candev(dev);
+		return err;
+	}
+
+	can_led_event(dev, CAN_LED_EVENT_OPEN);
+	netif_start_queue(dev);
+
+	return 0;
+}
+
+/* Replaces sja1000_close() */
+static int adv_stop(struct net_device *dev)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+	struct adv_pci_port *port = priv->priv;
+
+	netif_stop_queue(dev);
+	hrtimer_cancel(&port->tx_pace_timer);
+
+	priv->write_reg(priv, SJA1000_IER, IRQ_OFF);
+	if (adv_set_mode(priv, MOD_RM))
+		netdev_err(dev, "setting reset mode failed\n");
+	priv->can.state = CAN_STATE_STOPPED;
+
+	spin_lock_irq(&port->fc_lock);
+	port->fc_count = 0;
+	spin_unlock_irq(&port->fc_lock);
+
+	close_candev(dev);
+	can_led_event(dev, CAN_LED_EVENT_STOP);
+
+	return 0;
+}
+
+/* A restart after bus off drops the frame in the TX buffer */
+static int adv_do_set_mode(struct net_device *dev, enum can_mode mode)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+	struct adv_pci_port *port = priv->priv;
+	int err;
+
+	if (mode != CAN_MODE_START)
+		return port->core_set_mode(dev, mode);
+
+	err = adv_start(port);
+	if (err)
+		return err;
+
+	if (netif_queue_stopped(dev))
+		netif_wake_queue(dev);
+
+	return 0;
+}
+
+/* Bit timing for an exact bitrate with the sample point near 87.5 %,
+ * the most time quanta first. can_calc_bittiming() of the core is not
+ * exported.
+ */
+static int adv_calc_bittiming(const struct sja1000_priv *priv, u32 bitrate,
+			      struct can_bittiming *bt)
+{
+	const struct can_bittiming_const *btc = priv->can.bittiming_const;
+	u32 freq = priv->can.clock.freq;
+	u32 brp, ntq, tseg1, tseg2;
+
+	if (!bitrate || bitrate > freq)
+		return -EINVAL;
+
+	for (brp = btc->brp_min; brp <= btc->brp_max; brp += btc->brp_inc) {
+		/* Also keeps brp * bitrate from wrapping */
+		if ((u64)brp * bitrate > freq)
+			break;
+		if (freq % (brp * bitrate))
+			continue;
+		ntq = freq / (brp * bitrate);
+		if (ntq < 1 + btc->tseg1_min + btc->tseg2_min ||
+		    ntq > 1 + btc->tseg1_max + btc->tseg2_max)
+			continue;
+
+		tseg2 = clamp_t(u32, DIV_ROUND_CLOSEST(ntq, 8),
+				btc->tseg2_min, btc->tseg2_max);
+		tseg1 = ntq - 1 - tseg2;
+		if (tseg1 > btc->tseg1_max) {
+			tseg1 = btc->tseg1_max;
+			tseg2 = ntq - 1 - tseg1;
+		}
+
+		memset(bt, 0, sizeof(*bt));
+		bt->bitrate = bitrate;
+		bt->brp = brp;
+		bt->tq = div_u64((u64)brp * NSEC_PER_SEC, freq);
+		bt->prop_seg = tseg1 / 2;
+		bt->phase_seg1 = tseg1 - bt->prop_seg;
+		bt->phase_seg2 = tseg2;
+		bt->sjw = 1;
+		bt->sample_point = (1 + tseg1) * 1000 / ntq;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* As sja1000_set_bittiming(), in reset mode */
+static void adv_write_btr(struct sja1000_priv *priv,
+			  const struct can_bittiming *bt)
+{
+	u8 btr0, btr1;
+
+	btr0 = ((bt->brp - 1) & 0x3f) | (((bt->sjw - 1) & 0x3) << 6);
+	btr1 = ((bt->prop_seg + bt->phase_seg1 - 1) & 0xf) |
+		(((bt->phase_seg2 - 1) & 0x7) << 4);
+	if (priv->can.ctrlmode & CAN_CTRLMODE_3_SAMPLES)
+		btr1 |= 0x80;
+
+	priv->write_reg(priv, SJA1000_BTR0, btr0);
+	priv->write_reg(priv, SJA1000_BTR1, btr1);
+}
+
+/* Longest wait for the frame in the transmit buffer before a switch */
+#define ADV_BR_TX_WAIT_MS	20
+
+/* Change the bitrate of a running port. Only BTR0 and BTR1 are written
+ * in reset mode; error counters, the net device queue and the sockets
+ * stay as they are. The frame in the transmit buffer is sent first.
+ * Frames arriving during the switch are lost. A port in bus off is left
+ * to its restart. When the controller does not follow, the port is
+ * restarted with the old bitrate, or else left stopped with its queue
+ * stopped until it is taken down. Called under RTNL.
+ */
+static int adv_switch_bitrate(struct adv_pci_port *port,
+			      const struct can_bittiming *bt)
+{
+	struct net_device *dev = port->dev;
+	struct sja1000_priv *priv = netdev_priv(dev);
+	unsigned long timeout;
+	u64 start;
+	int err = 0;
+	u8 ier;
+
+	if (priv->can.state == CAN_STATE_BUS_OFF)
+		return -EBUSY;
+
+	spin_lock_irq(&port->tx_lock);
+	port->tx_hold = true;
+	spin_unlock_irq(&port->tx_lock);
+	netif_tx_disable(dev);
+	hrtimer_cancel(&port->tx_pace_timer);
+
+	/* Frames from adv_can_xmit() are not accounted in tx_bql, the
+	 * controller tells when its buffer is free. tx_bql also waits for
+	 * the interrupt completing a frame from the stack.
+	 */
+	timeout = jiffies + msecs_to_jiffies(ADV_BR_TX_WAIT_MS);
+	while (port->tx_bql ||
+	       !(priv->read_reg(priv, SJA1000_SR) & SR_TBS)) {
+		if (time_after(jiffies, timeout)) {
+			err = -EBUSY;
+			goto out;
+		}
+		usleep_range(20, 50);
+	}
+
+	ier = port->ier;
+	priv->write_reg(priv, SJA1000_IER, IRQ_OFF);
+	synchronize_irq(port->card->pdev->irq);
+	if (irq_thread)
+		synchronize_rcu();
+
+	start = ktime_get_ns();
+	if (adv_set_mode(priv, MOD_RM)) {
+		err = -ETIMEDOUT;
+	} else {
+		adv_write_btr(priv, bt);
+		err = adv_set_mode(priv, adv_normal_mod(priv));
+	}
+	port->br_switch_ns = ktime_get_ns() - start;
+
+	if (!err) {
+		priv->can.bittiming = *bt;
+		priv->read_reg(priv, SJA1000_IR);
+		priv->write_reg(priv, SJA1000_IER, ier);
+		goto out;
+	}
+
+	netdev_err(dev, "bitrate switch failed\n");
+	if (!adv_set_mode(priv, MOD_RM)) {
+		/* BTR may already hold the new timing */
+		adv_write_btr(priv, &priv->can.bittiming);
+		priv->can.state = CAN_STATE_STOPPED;
+		if (!adv_start(port))
+			goto out;
+	}
+	netdev_err(dev, "restart failed, port stopped\n");
+	priv->can.state = CAN_STATE_STOPPED;
+	port->tx_hold = false;
+
+	return err;
+
+out:
+	port->tx_hold = false;
+	netif_wake_queue(dev);
+	if (port->fc_count)
+		adv_isotp_flush(port);
+	adv_pktgen_kick(port);
+
+	return err;
+}
+
+static void adv_pmu_event_destroy(struct perf_event *event)
+{
+	static_key_slow_dec(&adv_pmu_active);
+}
+
+static struct pmu adv_pmu;
+
+static int adv_pmu_event_init(struct perf_event *event)
+{
+	if (event->attr.type != adv_pmu.type)
+		return -ENOENT;
+
+	/* The counters are summed over all CPUs, there is no task context */
+	if (event->cpu < 0)
+		return -EINVAL;
+
+	/* perf_event_overflow() is not available to modules */
+	if (is_sampling_event(event))
+		return -EOPNOTSUPP;
+
+	if (ADV_PMU_EVENT(event->attr.config) >= ADV_PMU_NR_EVENTS)
+		return -EINVAL;
+
+	static_key_slow_inc(&adv_pmu_active);
+	event->destroy = adv_pmu_event_destroy;
+
+	return 0;
+}
+
+static void adv_pmu_start(struct perf_event *event, int flags)
+{
+	event->hw.state = 0;
+}
+
+static void adv_pmu_stop(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED;
+}
+
+static int adv_pmu_add(struct perf_event *event, int flags)
+{
+	struct adv_pmu_events *events = this_cpu_ptr(adv_pmu_events);
+
+	event->hw.state = PERF_HES_STOPPED;
+	hlist_add_head_rcu(&event->hlist_entry,
+			   &events->head[ADV_PMU_EVENT(event->attr.config)]);
+	if (flags & PERF_EF_START)
+		adv_pmu_start(event, flags);
+
+	return 0;
+}
+
+static void adv_pmu_del(struct perf_event *event, int flags)
+{
+	hlist_del_rcu(&event->hlist_entry);
+}
+
+/* The count is updated in place as events happen */
+static void adv_pmu_read(struct perf_event *event)
+{
+}
+
+struct adv_pmu_attr {
+	struct device_attribute attr;
+	const char *str;
+};
+
+static ssize_t adv_pmu_attr_show(struct device *dev,
+				 struct device_attribute *attr, char *page)
+{
+	struct adv_pmu_attr *pa = container_of(attr, struct adv_pmu_attr, attr);
+
+	return sprintf(page, "%s\n", pa->str);
+}
+
+#define ADV_PMU_ATTR(_name, _str)					\
+	(&((struct adv_pmu_attr[]) {					\
+		{ __ATTR(_name, 0444, adv_pmu_attr_show, NULL), _str }	\
+	})[0].attr.attr)
+
+static struct attribute *adv_pmu_format_attrs[] = {
+	ADV_PMU_ATTR(event, "config:0-7"),
+	ADV_PMU_ATTR(ports, "config:8-11"),
+	ADV_PMU_ATTR(cards, "config:16-23"),
+	NULL
+};
+
+static struct attribute *adv_pmu_event_attrs[] = {
+	ADV_PMU_ATTR(mmio_reads, "event=0x00"),
+	ADV_PMU_ATTR(mmio_writes, "event=0x01"),
+	ADV_PMU_ATTR(irqs, "event=0x02"),
+	ADV_PMU_ATTR(rx_frames, "event=0x03"),
+	ADV_PMU_ATTR(overruns, "event=0x04"),
+	ADV_PMU_ATTR(spurious_irqs, "event=0x05"),
+	NULL
+};
+
+static const struct attribute_group adv_pmu_format_group = {
+	.name = "format",
+	.attrs = adv_pmu_format_attrs,
+};
+
+static const struct attribute_group adv_pmu_events_group = {
+	.name = "events",
+	.attrs = adv_pmu_event_attrs,
+};
+
+static const struct attribute_group *adv_pmu_attr_groups[] = {
+	&adv_pmu_format_group,
+	&adv_pmu_events_group,
+	NULL
+};
+
+static struct pmu adv_pmu = {
+	.module = THIS_MODULE,
+	.task_ctx_nr = perf_invalid_context,
+	.capabilities = PERF_PMU_CAP_NO_INTERRUPT,
+	.attr_groups = adv_pmu_attr_groups,
+	.event_init = adv_pmu_event_init,
+	.add = adv_pmu_add,
+	.del = adv_pmu_del,
+	.start = adv_pmu_start,
+	.stop = adv_pmu_stop,
+	.read = adv_pmu_read,
+};
+
+static int adv_pmu_init(void)
+{
+	struct adv_pmu_events *events;
+	int cpu, i, err;
+
+	adv_pmu_events = alloc_percpu(struct adv_pmu_events);
+	if (!adv_pmu_events)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		events = per_cpu_ptr(adv_pmu_events, cpu);
+		for (i = 0; i < ADV_PMU_NR_EVENTS; i++)
+			INIT_HLIST_HEAD(&events->head[i]);
+	}
+
+	err = perf_pmu_register(&adv_pmu, "advantech_can", -1);
+	if (err) {
+		free_percpu(adv_pmu_events);
+		adv_pmu_events = NULL;
+	}
+
+	return err;
+}
+
+static void adv_pmu_exit(void)
+{
+	perf_pmu_unregister(&adv_pmu);
+	free_percpu(adv_pmu_events);
+}
+
+/* Self test sends frames through the transmit path of the driver with
+ * the controller in self test mode with self reception, so no bus is
+ * needed. The receive hooks take the frames back, and the round trip is
+ * from handing the skb to the device to the frame in the hooks.
+ */
+#define ADV_TEST_FRAMES		64
+#define ADV_TEST_TIMEOUT_MS	100
+
+enum {
+	ADV_TEST_LOOPBACK,
+	ADV_TEST_RTT_MIN,
+	ADV_TEST_RTT_AVG,
+	ADV_TEST_RTT_MAX,
+	ADV_TEST_LEN
+};
+
+static const char adv_test_strings[ADV_TEST_LEN][ETH_GSTRING_LEN] = {
+	"loopback errors (offline)",
+	"loopback rtt min ns",
+	"loopback rtt avg ns",
+	"loopback rtt max ns",
+};
+
+static void adv_test_frame(struct can_frame *cf, int n)
+{
+	int i;
+
+	memset(cf, 0, sizeof(*cf));
+	if (n & 1)
+		cf->can_id = CAN_EFF_FLAG |
+			((0x15555555 ^ (n << 8)) & CAN_EFF_MASK);
+	else
+		cf->can_id = (0x2aa ^ n) & CAN_SFF_MASK;
+	cf->can_dlc = n % (CAN_MAX_DLEN + 1);
+	for (i = 0; i < cf->can_dlc; i++)
+		cf->data[i] = n + 0x11 * i;
+}
+
+/* Restart the running controller in the current control mode */
+static int adv_test_restart(struct adv_pci_port *port)
+{
+	struct net_device *dev = port->dev;
+	struct sja1000_priv *priv = netdev_priv(dev);
+	int err;
+
+	netif_tx_disable(dev);
+	priv->write_reg(priv, SJA1000_IER, IRQ_OFF);
+	synchronize_irq(port->card->pdev->irq);
+	if (irq_thread)
+		synchronize_rcu();
+
+	/* A frame in the transmit buffer is lost */
+	can_free_echo_skb(dev, 0);
+	err = adv_start(port);
+	if (err) {
+		/* The queue stays stopped until the port is taken down */
+		priv->can.state = CAN_STATE_STOPPED;
+		return err;
+	}
+	netif_wake_queue(dev);
+
+	return 0;
+}
+
+static void adv_test_set(struct adv_pci_port *port, struct adv_test *t)
+{
+	mutex_lock(&adv_rx_hook_lock);
+	port->test = t;
+	adv_rx_update_hooks(port);
+	mutex_unlock(&adv_rx_hook_lock);
+}
+
+static int adv_loopback_test(struct net_device *dev, u64 *data)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+	struct adv_pci_port *port = priv->priv;
+	u32 ctrlmode = priv->can.ctrlmode;
+	u64 rtt, total = 0;
+	int errors = 0, done = 0, n;
+	struct can_frame tx, *cf;
+	struct sk_buff *skb;
+	struct adv_test t;
+
+	init_completion(&t.done);
+	t.id = CAN_ERR_FLAG;
+	adv_test_set(port, &t);
+
+	/* Self reception and no acknowledge needed */
+	priv->can.ctrlmode |= CAN_CTRLMODE_LOOPBACK | CAN_CTRLMODE_PRESUME_ACK;
+	if (adv_test_restart(port)) {
+		errors = ADV_TEST_FRAMES;
+		goto out;
+	}
+
+	data[ADV_TEST_RTT_MIN] = U64_MAX;
+	for (n = 0; n < ADV_TEST_FRAMES; n++) {
+		adv_test_frame(&tx, n);
+		skb = alloc_can_skb(dev, &cf);
+		if (!skb) {
+			errors++;
+			continue;
+		}
+		*cf = tx;
+
+		reinit_completion(&t.done);
+		t.id = tx.can_id;
+		t.start = ktime_get_ns();
+		dev_queue_xmit(skb);
+		if (!wait_for_completion_timeout(&t.done,
+				msecs_to_jiffies(ADV_TEST_TIMEOUT_MS))) {
+			errors++;
+			continue;
+		}
+		rtt = t.ns - t.start;
+
+		if (t.rx.can_dlc != tx.can_dlc ||
+		    memcmp(t.rx.data, tx.data, tx.can_dlc)) {
+			errors++;
+			continue;
+		}
+
+		data[ADV_TEST_RTT_MIN] = min(data[ADV_TEST_RTT_MIN], rtt);
+		data[ADV_TEST_RTT_MAX] = max(data[ADV_TEST_RTT_MAX], rtt);
+		total += rtt;
+		done++;
+	}
+
+out:
+	/* The restart waits for the handler to be done with t */
+	adv_test_set(port, NULL);
+	priv->can.ctrlmode = ctrlmode;
+	if (adv_test_restart(port)) {
+		netdev_err(dev, "restoring the port after the test failed\n");
+		errors++;
+	}
+
+	if (done)
+		data[ADV_TEST_RTT_AVG] = div_u64(total, done);
+	else
+		data[ADV_TEST_RTT_MIN] = 0;
+
+	return errors;
+}
+
+static void adv_self_test(struct net_device *dev, struct ethtool_test *etest,
+			  u64 *data)
+{
+	int errors;
+
+	memset(data, 0, ADV_TEST_LEN * sizeof(*data));
+
+	/* The test takes over the port, so it is offline only */
+	if (!(etest->flags & ETH_TEST_FL_OFFLINE))
+		return;
+
+	if (!netif_running(dev)) {
+		netdev_warn(dev, "self test needs the interface up\n");
+		errors = ADV_TEST_FRAMES;
+	} else {
+		errors = adv_loopback_test(dev, data);
+	}
+
+	data[ADV_TEST_LOOPBACK] = errors;
+	if (errors)
+		etest->flags |= ETH_TEST_FL_FAILED;
+}
+
+static int adv_get_sset_count(struct net_device *dev, int sset)
+{
+	switch (sset) {
+	case ETH_SS_TEST:
+		return ADV_TEST_LEN;
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+static void adv_get_strings(struct net_device *dev, u32 sset, u8 *data)
+{
+	switch (sset) {
+	case ETH_SS_TEST:
+		memcpy(data, adv_test_strings, sizeof(adv_test_strings));
+		break;
+	}
+}
+
+static const struct ethtool_ops adv_ethtool_ops = {
+	.get_sset_count = adv_get_sset_count,
+	.get_strings = adv_get_strings,
+	.self_test = adv_self_test,
+};
+
+/* In-kernel API */
+
+static struct adv_pci_port *adv_port_of(struct net_device *dev)
+{
+	struct sja1000_priv *priv = netdev_priv(dev);
+
+	if (dev->ethtool_ops != &adv_ethtool_ops)
+		return NULL;
+
+	return priv->priv;
+}
+
+struct adv_can_rx_hook *adv_can_rx_register(struct net_device *dev,
+					    canid_t id, canid_t mask,
+					    adv_can_rx_fn fn, void *data)
+{
+	struct adv_pci_port *port = adv_port_of(dev);
+	struct adv_can_rx_hook *h;
+
+	if (!port)
+		return ERR_PTR(-ENODEV);
+
+	h = kzalloc_node(sizeof(*h), GFP_KERNEL, port->card->node);
+	if (!h)
+		return ERR_PTR(-ENOMEM);
+	h->port = port;
+	h->id = id;
+	h->mask = mask;
+	h->fn = fn;
+	h->data = data;
+
+	dev_hold(dev);
+	mutex_lock(&adv_rx_hook_lock);
+	list_add_tail_rcu(&h->list, &port->rx_cbs);
+	adv_rx_update_hooks(port);
+	mutex_unlock(&adv_rx_hook_lock);
+
+	return h;
+}
+EXPORT_SYMBOL_GPL(adv_can_rx_register);
+
+void adv_can_rx_unregister(struct adv_can_rx_hook *h)
+{
+	struct adv_pci_port *port = h->port;
+
+	mutex_lock(&adv_rx_hook_lock);
+	list_del_rcu(&h->list);
+	adv_rx_update_hooks(port);
+	mutex_unlock(&adv_rx_hook_lock);
+
+	/* The callback may be running in the interrupt handler */
+	synchronize_rcu();
+	dev_put(port->dev);
+	kfree(h);
+}
+EXPORT_SYMBOL_GPL(adv_can_rx_unregister);
+
+/* As sja1000_start_xmit() does, without the echo skb */
+static void adv_tx_write(struct sja1000_priv *priv, const struct can_frame *cf)
+{
+	canid_t id = cf->can_id;
+	u8 fi, dlc = cf->can_dlc;
+	u8 cmd = CMD_TR;
+	unsigned long flags;
+	int dreg, i;
+
+	fi = dlc;
+	if (id & CAN_RTR_FLAG)
+		fi |= SJA1000_FI_RTR;
+
+	if (id & CAN_EFF_FLAG) {
+		fi |= SJA1000_FI_FF;
+		dreg = SJA1000_EFF_BUF;
+		priv->write_reg(priv, SJA1000_FI, fi);
+		priv->write_reg(priv, SJA1000_ID1, (id & 0x1fe00000) >> 21);
+		priv->write_reg(priv, SJA1000_ID2, (id & 0x001fe000) >> 13);
+		priv->write_reg(priv, SJA1000_ID3, (id & 0x00001fe0) >> 5);
+		priv->write_reg(priv, SJA1000_ID4, (id & 0x0000001f) << 3);
+	} else {
+		dreg = SJA1000_SFF_BUF;
+		priv->write_reg(priv, SJA1000_FI, fi);
+		priv->write_reg(priv, SJA1000_ID1, (id & 0x000007f8) >> 3);
+		priv->write_reg(priv, SJA1000_ID2, (id & 0x00000007) << 5);
+	}
+
+	for (i = 0; i < dlc; i++)
+		priv->write_reg(priv, dreg++, cf->data[i]);
+
+	if (priv->can.ctrlmode & CAN_CTRLMODE_ONE_SHOT)
+		cmd |= CMD_AT;
+	if (priv->can.ctrlmode & CAN_CTRLMODE_LOOPBACK)
+		cmd = (cmd & ~CMD_TR) | CMD_SRR;
+
+	/* As sja1000_write_cmdreg() does */
+	spin_lock_irqsave(&priv->cmdreg_lock, flags);
+	priv->write_reg(priv, SJA1000_CMR, cmd);
+	priv->read_reg(priv, SJA1000_SR);
+	spin_unlock_irqrestore(&priv->cmdreg_lock, flags);
+}
+
+/* Goes through the same checks as adv_start_xmit() under tx_lock, which
+ * unlike the queue lock may be taken in the interrupt handler. A paced
+ * frame is refused; the pace timer then wakes the queue when it is due.
+ * The core wakes the queue on the transmit interrupt.
+ */
+int adv_can_xmit(struct net_device *dev, const struct can_frame *cf)
+{
+	struct adv_pci_port *port = adv_port_of(dev);
+	unsigned long flags;
+	int err = 0;
+
+	if (!port)
+		return -ENODEV;
+	if (cf->can_dlc > CAN_MAX_DLEN)
+		return -EINVAL;
+	if (!netif_running(dev))
+		return -ENETDOWN;
+
+	spin_lock_irqsave(&port->tx_lock, flags);
+	if (netif_queue_stopped(dev) || port->tx_hold ||
+	    adv_tx_paced(port, dev)) {
+		err = -EBUSY;
+	} else if (adv_tx_id_limit(port, cf)) {
+		dev->stats.tx_dropped++;
+		err = -ENOBUFS;
+	} else {
+		adv_tx_pace_charge(port, dev, cf);
+		netif_stop_queue(dev);
+		port->tx_id = cf->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK);
+		adv_tx_write(netdev_priv(dev), cf);
+	}
+	spin_unlock_irqrestore(&port->tx_lock, flags);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(adv_can_xmit);
+
+/* Stall watchdog
+ *
+ * Controllers have been seen to stop interrupting while the bus is
+ * active. A port is stalled when it has had no interrupts for two checks
+ * while a received frame waits in the buffer or a transmitted frame has
+ * left the buffer. The port is then reinitialised with its current
+ * settings; the other ports keep running.
+ */
+static bool adv_port_stalled(struct adv_pci_port *port, u8 *sr)
+{
+	struct net_device *dev = port->dev;
+	struct sja1000_priv *priv = netdev_priv(dev);
+
+	/* A port left stopped by a failed reinitialisation */
+	if (netif_running(dev) && port->reinit_failed) {
+		*sr = adv_mmio_read(priv, SJA1000_SR);
+		return true;
+	}
+
+	if (!netif_running(dev) || port->ier == IRQ_OFF ||
+	    priv->can.state >= CAN_STATE_BUS_OFF ||
+	    port->irq_count != port->irq_count_seen) {
+		port->irq_count_seen = port->irq_count;
+		port->stall_checks = 0;
+		return false;
+	}
+
+	*sr = adv_mmio_read(priv, SJA1000_SR);
+	if (!(*sr & SR_RBS) &&
+	    !((*sr & SR_TBS) && netif_queue_stopped(dev))) {
+		port->stall_checks = 0;
+		return false;
+	}
+
+	return ++port->stall_checks >= 2;
+}
+
+/* As chipset_init() of the core, in reset mode */
+static void adv_chipset_init(struct sja1000_priv *priv)
+{
+	int i;
+
+	priv->write_reg(priv, SJA1000_CDR, priv->cdr | CDR_PELICAN);
+	for (i = 0; i < 4; i++) {
+		priv->write_reg(priv, SJA1000_ACCC0 + i, 0x00);
+		priv->write_reg(priv, SJA1000_ACCM0 + i, 0xff);
+	}
+	priv->write_reg(priv, SJA1000_OCR, priv->ocr | OCR_MODE_NORMAL);
+}
+
+static void adv_ports_reinit(struct adv_pci_card *card, unsigned int mask,
+			     const u8 *sr)
+{
+	u8 mod[ARRAY_SIZE(card->port)];
+	struct adv_pci_port *port;
+	struct sja1000_priv *priv;
+	unsigned int failed;
+	int i;
+
+	if (!mask)
+		return;
+
+	for (i = 0; i < card->nr_ports; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		port = &card->port[i];
+		priv = netdev_priv(port->dev);
+		port->stall_checks = 0;
+		if (!port->reinit_failed) {
+			port->stalls++;
+			netdev_warn(port->dev,
+				    "stalled (SR 0x%02x), reinitialising\n",
+				    sr[i]);
+		}
+
+		/* The card handler skips the port while its interrupts
+		 * are off
+		 */
+		priv->write_reg(priv, SJA1000_IER, IRQ_OFF);
+		mod[i] = MOD_RM;
+	}
+	synchronize_irq(card->pdev->irq);
+	if (irq_thread)
+		synchronize_rcu();
+
+	for (i = 0; i < card->nr_ports; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		hrtimer_cancel(&card->port[i].tx_pace_timer);
+		netif_tx_disable(card->port[i].dev);
+	}
+
+	failed = adv_ports_set_mode(card, mask, mod);
+	for (i = 0; i < card->nr_ports; i++) {
+		if (!(mask & ~failed & BIT(i)))
+			continue;
+		port = &card->port[i];
+		priv = netdev_priv(port->dev);
+		priv->can.state = CAN_STATE_STOPPED;
+		/* A stalled controller may have lost its setup */
+		if (!(priv->read_reg(priv, SJA1000_CDR) & CDR_PELICAN)) {
+			netdev_warn(port->dev,
+				    "controller left PeliCAN mode\n");
+			adv_chipset_init(priv);
+		}
+		priv->can.do_set_bittiming(port->dev);
+		can_free_echo_skb(port->dev, 0);
+		adv_start_prepare(port);
+		mod[i] = adv_normal_mod(priv);
+	}
+	failed |= adv_ports_set_mode(card, mask & ~failed, mod);
+
+	for (i = 0; i < card->nr_ports; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		port = &card->port[i];
+		if (failed & BIT(i)) {
+			if (!port->reinit_failed)
+				netdev_err(port->dev,
+					   "reinitialising failed, retrying\n");
+			port->reinit_failed = true;
+			priv = netdev_priv(port->dev);
+			priv->can.state = CAN_STATE_STOPPED;
+			continue;
+		}
+		adv_start_done(port);
+		netif_wake_queue(port->dev);
+	}
+}
+
+/* Error counters are sampled at each check for the bus_health trend */
+static void adv_err_sample(struct adv_pci_port *port)
+{
+	struct net_device *dev = port->dev;
+	struct sja1000_priv *priv = netdev_priv(dev);
+	struct adv_err_sample *e = &port->trend[port->trend_next];
+	u8 level;
+
+	e->ns = ktime_get_ns();
+	e->txerr = adv_mmio_read(priv, SJA1000_TXERR);
+	e->rxerr = adv_mmio_read(priv, SJA1000_RXERR);
+	e->state = priv->can.state;
+	port->trend_next = (port->trend_next + 1) % ADV_TREND_LEN;
+	if (port->trend_count < ADV_TREND_LEN)
+		port->trend_count++;
+
+	level = max(e->txerr, e->rxerr);
+	if (port->err_warn && !port->err_warned && level >= port->err_warn) {
+		port->err_warned = true;
+		netdev_warn(dev, "error counters rising, tx %u rx %u\n",
+			    e->txerr, e->rxerr);
+	} else if (port->err_warned && level < port->err_warn / 2) {
+		port->err_warned = false;
+		netdev_info(dev, "error counters recovered, tx %u rx %u\n",
+			    e->txerr, e->rxerr);
+	}
+}
+
+static void adv_watchdog(struct work_struct *work)
+{
+	struct adv_pci_card *card = container_of(work, struct adv_pci_card,
+						 watchdog.work);
+	u8 sr[ARRAY_SIZE(card->port)];
+	struct adv_pci_port *port;
+	unsigned int stalled = 0;
+	int i;
+
+	for (i = 0; i < card->nr_ports; i++) {
+		port = &card->port[i];
+		if (!port->dev)
+			continue;
+		if (netif_running(port->dev))
+			adv_err_sample(port);
+		if (adv_port_stalled(port, &sr[i]))
+			stalled |= BIT(i);
+	}
+
+	if (stalled) {
+		rtnl_lock();
+		for (i = 0; i < card->nr_ports; i++)
+			if ((stalled & BIT(i)) &&
+			    !netif_running(card->port[i].dev))
+				stalled &= ~BIT(i);
+		adv_ports_reinit(card, stalled, sr);
+		rtnl_unlock();
+	}
+
+	schedule_delayed_work(&card->watchdog, msecs_to_jiffies(watchdog_ms));
+}
+
+/* Packet generator */
+
+static const char * const adv_pktgen_modes[] = {
+	[ADV_PKTGEN_FIXED] = "fixed",
+	[ADV_PKTGEN_INC] = "inc",
+	[ADV_PKTGEN_RANDOM] = "random",
+};
+
+static void adv_pktgen_fill(struct adv_pktgen *pg, struct can_frame *cf,
+			    u64 n)
+{
+	canid_t mask = pg->id_mask;
+	u32 rnd;
+	int i;
+
+	switch (pg->id_mode) {
+	case ADV_PKTGEN_FIXED:
+		cf->can_id = pg->id;
+		break;
+	case ADV_PKTGEN_INC:
+		cf->can_id = (pg->id & ~mask) | ((pg->id + n) & mask);
+		break;
+	case ADV_PKTGEN_RANDOM:
+		cf->can_id = (pg->id & ~mask) | (prandom_u32() & mask);
+		break;
+	}
+
+	cf->can_dlc = pg->dlc;
+	for (i = 0; i < pg->dlc; i++) {
+		switch (pg->data_mode) {
+		case ADV_PKTGEN_FIXED:
+			cf->data[i] = pg->data[i];
+			break;
+		case ADV_PKTGEN_INC:
+			cf->data[i] = pg->data[i] + n;
+			break;
+		case ADV_PKTGEN_RANDOM:
+			if (!(i & 3))
+				rnd = prandom_u32();
+			cf->data[i] = rnd >> (8 * (i & 3));
+			break;
+		}
+	}
+}
+
+/* Longest sleep for a queue wake that went unseen */
+#define ADV_PKTGEN_WAIT_MS	10
+
+/* Hand the frame to the driver transmit function, bypassing the qdisc.
+ * Sleeps until the single transmit buffer is free when the queue is
+ * stopped; the transmit interrupt and the pace timer wake the thread.
+ */
+static int adv_pktgen_xmit(struct adv_pci_port *port, struct sk_buff *skb)
+{
+	struct net_device *dev = port->dev;
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, 0);
+	netdev_tx_t ret;
+
+	for (;;) {
+		if (!netif_running(dev) || kthread_should_stop()) {
+			kfree_skb(skb);
+			return -ENETDOWN;
+		}
+
+		__netif_tx_lock_bh(txq);
+		if (!netif_xmit_frozen_or_stopped(txq)) {
+			ret = dev->netdev_ops->ndo_start_xmit(skb, dev);
+			__netif_tx_unlock_bh(txq);
+			if (ret == NETDEV_TX_OK)
+				return 0;
+		} else {
+			__netif_tx_unlock_bh(txq);
+		}
+
+		wait_event_interruptible_timeout(port->pktgen.tx_wait,
+				!netif_xmit_frozen_or_stopped(txq) ||
+				!netif_running(dev) || kthread_should_stop(),
+				msecs_to_jiffies(ADV_PKTGEN_WAIT_MS));
+	}
+}
+
+static void adv_pktgen_wait(u64 until)
+{
+	ktime_t expires;
+	u64 now = ktime_get_ns();
+
+	/* Sleep for the bulk of long waits, spin for precision */
+	if (until > now + 50 * NSEC_PER_USEC) {
+		expires = ns_to_ktime(until - 20 * NSEC_PER_USEC);
+		set_current_state(TASK_INTERRUPTIBLE);
+		schedule_hrtimeout(&expires, HRTIMER_MODE_ABS);
+	}
+
+	while (ktime_get_ns() < until && !kthread_should_stop())
+		cpu_relax();
+}
+
+static int adv_pktgen_thread(void *arg)
+{
+	struct adv_pci_port *port = arg;
+	struct adv_pktgen *pg = &port->pktgen;
+	struct net_device *dev = port->dev;
+	struct can_frame *cf;
+	struct sk_buff *skb;
+	u64 next, interval = 0;
+	unsigned int bits;
+	u32 b;
+
+	if (pg->rate)
+		interval = div_u64((u64)NSEC_PER_SEC * pg->burst, pg->rate);
+
+	spin_lock(&pg->stats_lock);
+	pg->start_ns = next = ktime_get_ns();
+	spin_unlock(&pg->stats_lock);
+	while (!kthread_should_stop() && (!pg->count || pg->sent < pg->count)) {
+		if (interval) {
+			adv_pktgen_wait(next);
+			next += interval;
+		}
+
+		/* A failed allocation is retried, not skipped */
+		for (b = 0; b < pg->burst && !kthread_should_stop(); ) {
+			if (pg->count && pg->sent >= pg->count)
+				break;
+
+			skb = alloc_can_skb(dev, &cf);
+			if (!skb) {
+				spin_lock(&pg->stats_lock);
+				pg->alloc_failed++;
+				spin_unlock(&pg->stats_lock);
+				cond_resched();
+				continue;
+			}
+			adv_pktgen_fill(pg, cf, pg->sent);
+			bits = adv_can_frame_bits(cf);
+
+			if (adv_pktgen_xmit(port, skb))
+				goto done;
+
+			spin_lock(&pg->stats_lock);
+			pg->sent++;
+			pg->bits += bits;
+			pg->end_ns = ktime_get_ns();
+			spin_unlock(&pg->stats_lock);
+			b++;
+		}
+	}
+
+done:
+	/* Wait for adv_pktgen_stop() to reap us */
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static void adv_pktgen_stop(struct adv_pci_port *port)
+{
+	struct adv_pktgen *pg = &port->pktgen;
+
+	mutex_lock(&pg->lock);
+	if (pg->task) {
+		kthread_stop(pg->task);
+		pg->task = NULL;
+	}
+	mutex_unlock(&pg->lock);
+}
+
+static int adv_pktgen_start(struct adv_pci_port *port)
+{
+	struct adv_pktgen *pg = &port->pktgen;
+	struct task_struct *task;
+
+	if (pg->task)
+		return -EBUSY;
+	if (!netif_running(port->dev))
+		return -ENETDOWN;
+
+	pg->sent = 0;
+	pg->bits = 0;
+	pg->alloc_failed = 0;
+	pg->end_ns = 0;
+	task = kthread_create_on_node(adv_pktgen_thread, port,
+				      port->card->node, "adv_pktgen/%s",
+				      port->dev->name);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+	pg->task = task;
+	wake_up_process(task);
+
+	return 0;
+}
+
+static int adv_pktgen_parse_mode(const char *str, enum adv_pktgen_mode *mode)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(adv_pktgen_modes); i++) {
+		if (!strcmp(str, adv_pktgen_modes[i])) {
+			*mode = i;
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/* Debugfs command files take commands one per line or separated by
+ * ';'. They are run in order under lock, stopping at the first error.
+ */
+static ssize_t adv_command_write(struct file *file, const char __user *buf,
+				 size_t count, struct mutex *lock,
+				 int (*command)(struct adv_pci_port *port,
+						char *line))
+{
+	struct seq_file *m = file->private_data;
+	struct adv_pci_port *port = m->private;
+	char cmd[256], *p, *line;
+	int err = 0;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = '\0';
+
+	mutex_lock(lock);
+	p = cmd;
+	while ((line = strsep(&p, "\n;")) && !err)
+		err = command(port, strim(line));
+	mutex_unlock(lock);
+
+	return err ? err : count;
+}
+
+/* One "key value" setting, "start" or "stop" per line */
+static int adv_pktgen_command(struct adv_pci_port *port, char *line)
+{
+	struct adv_pktgen *pg = &port->pktgen;
+	char key[16], arg[2 * CAN_MAX_DLEN + 1];
+	unsigned long long val;
+	int n;
+
+	n = sscanf(line, "%15s %16s", key, arg);
+	if (n < 1)
+		return 0;
+
+	if (!strcmp(key, "stop")) {
+		if (pg->task) {
+			kthread_stop(pg->task);
+			pg->task = NULL;
+		}
+		return 0;
+	}
+
+	/* Settings are fixed while running */
+	if (pg->task)
+		return -EBUSY;
+
+	if (!strcmp(key, "start"))
+		return adv_pktgen_start(port);
+
+	if (n < 2)
+		return -EINVAL;
+
+	if (!strcmp(key, "id_mode"))
+		return adv_pktgen_parse_mode(arg, &pg->id_mode);
+	if (!strcmp(key, "data_mode"))
+		return adv_pktgen_parse_mode(arg, &pg->data_mode);
+	if (!strcmp(key, "data")) {
+		memset(pg->data, 0, sizeof(pg->data));
+		if (strlen(arg) & 1)
+			return -EINVAL;
+		return hex2bin(pg->data, arg, strlen(arg) / 2);
+	}
+
+	if (kstrtoull(arg, 0, &val))
+		return -EINVAL;
+
+	if (!strcmp(key, "id")) {
+		if (val > CAN_SFF_MASK)
+			pg->id = (val & CAN_EFF_MASK) | CAN_EFF_FLAG;
+		else
+			pg->id = val;
+	} else if (!strcmp(key, "eff")) {
+		if (val)
+			pg->id |= CAN_EFF_FLAG;
+		else
+			pg->id &= CAN_SFF_MASK;
+	} else if (!strcmp(key, "id_mask")) {
+		pg->id_mask = val & CAN_EFF_MASK;
+	} else if (!strcmp(key, "dlc")) {
+		if (val > CAN_MAX_DLC)
+			return -EINVAL;
+		pg->dlc = val;
+	} else if (!strcmp(key, "rate")) {
+		pg->rate = min_t(u64, val, U32_MAX);
+	} else if (!strcmp(key, "count")) {
+		pg->count = val;
+	} else if (!strcmp(key, "burst")) {
+		if (!val || val > U32_MAX)
+			return -EINVAL;
+		pg->burst = val;
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int adv_pktgen_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	struct adv_pktgen *pg = &port->pktgen;
+	struct sja1000_priv *priv = netdev_priv(port->dev);
+	u32 bitrate = priv->can.bittiming.bitrate;
+	u64 elapsed = 0, fps = 0, load = 0;
+	u64 sent, bits, alloc_failed;
+
+	mutex_lock(&pg->lock);
+
+	spin_lock(&pg->stats_lock);
+	sent = pg->sent;
+	bits = pg->bits;
+	alloc_failed = pg->alloc_failed;
+	if (pg->end_ns > pg->start_ns)
+		elapsed = pg->end_ns - pg->start_ns;
+	spin_unlock(&pg->stats_lock);
+
+	if (elapsed) {
+		fps = div64_u64(sent * NSEC_PER_SEC, elapsed);
+		/* permille of the bus time */
+		if (bitrate)
+			load = div64_u64(bits * div_u64(NSEC_PER_SEC,
+							bitrate) * 1000,
+					 elapsed);
+	}
+
+	seq_printf(m, "state: %s\n", pg->task ? "running" : "stopped");
+	seq_printf(m, "id 0x%x\neff %d\nid_mask 0x%x\nid_mode %s\n",
+		   pg->id & CAN_EFF_MASK, !!(pg->id & CAN_EFF_FLAG),
+		   pg->id_mask, adv_pktgen_modes[pg->id_mode]);
+	seq_printf(m, "dlc %u\ndata %*phN\ndata_mode %s\n", pg->dlc,
+		   CAN_MAX_DLEN, pg->data, adv_pktgen_modes[pg->data_mode]);
+	seq_printf(m, "rate %u\ncount %llu\nburst %u\n",
+		   pg->rate, pg->count, pg->burst);
+	seq_printf(m, "sent: %llu\nelapsed_ns: %llu\nframes_per_sec: %llu\n",
+		   sent, elapsed, fps);
+	seq_printf(m, "alloc_failed: %llu\n", alloc_failed);
+	seq_printf(m, "bus_load: %llu.%llu%%\n", div_u64(load, 10),
+		   load % 10);
+
+	mutex_unlock(&pg->lock);
+
+	return 0;
+}
+
+static int adv_pktgen_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_pktgen_show, inode->i_private);
+}
+
+static ssize_t adv_pktgen_write(struct file *file, const char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct adv_pci_port *port = m->private;
+
+	return adv_command_write(file, buf, count, &port->pktgen.lock,
+				 adv_pktgen_command);
+}
+
+static const struct file_operations adv_pktgen_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_pktgen_open,
+	.read = seq_read,
+	.write = adv_pktgen_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int adv_hist_show(struct seq_file *m, void *v)
+{
+	struct adv_hist __percpu *hist = m->private;
+	u64 count;
+	int i;
+
+	seq_printf(m, "%12s %12s %12s\n", "from_ns", "to_ns", "count");
+	for (i = 0; i < ADV_HIST_BUCKETS; i++) {
+		count = adv_hist_sum(hist, i);
+		if (!count)
+			continue;
+		if (i == ADV_HIST_BUCKETS - 1)
+			seq_printf(m, "%12llu %12s %12llu\n",
+				   1ULL << (i - 1), "-", count);
+		else
+			seq_printf(m, "%12llu %12llu %12llu\n",
+				   i ? 1ULL << (i - 1) : 0,
+				   i ? (1ULL << i) - 1 : 0, count);
+	}
+
+	return 0;
+}
+
+static int adv_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_hist_show, inode->i_private);
+}
+
+/* Any write resets the histogram */
+static ssize_t adv_hist_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	adv_hist_reset(m->private);
+
+	return count;
+}
+
+static const struct file_operations adv_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_hist_open,
+	.read = seq_read,
+	.write = adv_hist_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int adv_isr_max_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_card *card = m->private;
+	int i;
+
+	seq_printf(m, "isr_ns %llu\n", card->isr_ns_max);
+	if (irq_thread)
+		seq_printf(m, "thread_ns %llu\n", card->thread_ns_max);
+	seq_printf(m, "frames %u\n", card->irq_frames_max);
+	for (i = 0; i < card->nr_ports; i++)
+		seq_printf(m, "port%d_frames %u\n", i,
+			   card->port[i].irq_frames_max);
+
+	return 0;
+}
+
+static int adv_isr_max_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_isr_max_show, inode->i_private);
+}
+
+/* Any write resets the maximums */
+static ssize_t adv_isr_max_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct adv_pci_card *card = m->private;
+	int i;
+
+	card->isr_ns_max = 0;
+	card->thread_ns_max = 0;
+	card->irq_frames_max = 0;
+	for (i = 0; i < card->nr_ports; i++)
+		card->port[i].irq_frames_max = 0;
+
+	return count;
+}
+
+static const struct file_operations adv_isr_max_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_isr_max_open,
+	.read = seq_read,
+	.write = adv_isr_max_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int adv_mode_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	u64 switches, last, longest, polls, timeouts;
+
+	spin_lock_irq(&port->mode_lock);
+	switches = port->mode_switches;
+	last = port->mode_ns_last;
+	longest = port->mode_ns_max;
+	polls = port->mode_polls;
+	timeouts = port->mode_timeouts;
+	spin_unlock_irq(&port->mode_lock);
+
+	seq_printf(m, "switches %llu\n", switches);
+	seq_printf(m, "last_ns %llu\n", last);
+	seq_printf(m, "max_ns %llu\n", longest);
+	seq_printf(m, "extra_reads %llu\n", polls);
+	seq_printf(m, "timeouts %llu\n", timeouts);
+
+	return 0;
+}
+
+static int adv_mode_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_mode_show, inode->i_private);
+}
+
+/* Any write resets the counters */
+static ssize_t adv_mode_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct adv_pci_port *port = m->private;
+
+	spin_lock_irq(&port->mode_lock);
+	port->mode_switches = 0;
+	port->mode_ns_last = 0;
+	port->mode_ns_max = 0;
+	port->mode_polls = 0;
+	port->mode_timeouts = 0;
+	spin_unlock_irq(&port->mode_lock);
+
+	return count;
+}
+
+static const struct file_operations adv_mode_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_mode_open,
+	.read = seq_read,
+	.write = adv_mode_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const char * const adv_ecc_types[] = {
+	"bit", "form", "stuff", "other"
+};
+
+static const char * const adv_ecc_segs[32] = {
+	[0x03] = "start of frame",
+	[0x02] = "id 28-21",
+	[0x06] = "id 20-18",
+	[0x04] = "srtr",
+	[0x05] = "ide",
+	[0x07] = "id 17-13",
+	[0x0f] = "id 12-5",
+	[0x0e] = "id 4-0",
+	[0x0c] = "rtr",
+	[0x0d] = "reserved 1",
+	[0x09] = "reserved 0",
+	[0x0b] = "dlc",
+	[0x0a] = "data",
+	[0x08] = "crc",
+	[0x18] = "crc delimiter",
+	[0x19] = "ack slot",
+	[0x1b] = "ack delimiter",
+	[0x1a] = "end of frame",
+	[0x12] = "intermission",
+	[0x11] = "active error flag",
+	[0x16] = "passive error flag",
+	[0x13] = "dominant bits",
+	[0x17] = "error delimiter",
+	[0x1c] = "overload flag",
+};
+
+static int adv_bus_health_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	struct adv_err_sample *e;
+	unsigned int i, n;
+
+	seq_printf(m, "ewl %u\n", port->ewl);
+	seq_printf(m, "err_warn %u\n", port->err_warn);
+
+	seq_puts(m, "\nbus errors\n");
+	for (i = 0; i < ARRAY_SIZE(adv_ecc_types); i++)
+		seq_printf(m, "%-20s %llu\n", adv_ecc_types[i],
+			   port->ecc_type[i]);
+	seq_printf(m, "%-20s %llu\n", "in tx", port->ecc_dir[0]);
+	seq_printf(m, "%-20s %llu\n", "in rx", port->ecc_dir[1]);
+	for (i = 0; i < ARRAY_SIZE(port->ecc_seg); i++)
+		if (port->ecc_seg[i])
+			seq_printf(m, "%-20s %llu\n", adv_ecc_segs[i] ?
+				   adv_ecc_segs[i] : "unknown",
+				   port->ecc_seg[i]);
+
+	seq_puts(m, "\narbitration lost at bit\n");
+	for (i = 0; i < ARRAY_SIZE(port->alc_bit); i++)
+		if (port->alc_bit[i])
+			seq_printf(m, "%-20u %llu\n", i, port->alc_bit[i]);
+
+	seq_printf(m, "\n%12s %5s %5s %5s\n", "time_ms", "txerr", "rxerr",
+		   "state");
+	n = port->trend_count;
+	for (i = 0; i < n; i++) {
+		e = &port->trend[(port->trend_next + ADV_TREND_LEN - n + i) %
+				 ADV_TREND_LEN];
+		seq_printf(m, "%12llu %5u %5u %5u\n",
+			   div_u64(e->ns, NSEC_PER_MSEC), e->txerr, e->rxerr,
+			   e->state);
+	}
+
+	return 0;
+}
+
+static int adv_bus_health_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_bus_health_show, inode->i_private);
+}
+
+/* Any write resets the error statistics */
+static ssize_t adv_bus_health_write(struct file *file,
+				    const char __user *buf, size_t count,
+				    loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct adv_pci_port *port = m->private;
+
+	memset(port->ecc_type, 0, sizeof(port->ecc_type));
+	memset(port->ecc_dir, 0, sizeof(port->ecc_dir));
+	memset(port->ecc_seg, 0, sizeof(port->ecc_seg));
+	memset(port->alc_bit, 0, sizeof(port->alc_bit));
+
+	return count;
+}
+
+static const struct file_operations adv_bus_health_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_bus_health_open,
+	.read = seq_read,
+	.write = adv_bus_health_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void adv_seq_id(struct seq_file *m, canid_t id)
+{
+	if (id == ADV_ALC_UNKNOWN)
+		seq_printf(m, " %8s", "?");
+	else if (id & CAN_EFF_FLAG)
+		seq_printf(m, " %08x", id & CAN_EFF_MASK);
+	else
+		seq_printf(m, " %8x", id);
+}
+
+static int adv_arbitration_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	struct adv_alc_pair *p;
+	int i;
+
+	seq_printf(m, "%8s %8s %12s %7s %7s\n", "tx_id", "winner", "losses",
+		   "bit_min", "bit_max");
+	for (i = 0; i < ADV_ALC_PAIRS; i++) {
+		p = &port->alc[i];
+		if (!p->count)
+			break;
+		adv_seq_id(m, p->tx_id);
+		adv_seq_id(m, p->winner);
+		seq_printf(m, " %12llu %7u %7u\n", p->count, p->bit_min,
+			   p->bit_max);
+	}
+	if (port->alc_overflow)
+		seq_printf(m, "overflow %llu\n", port->alc_overflow);
+
+	return 0;
+}
+
+static int adv_arbitration_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_arbitration_show, inode->i_private);
+}
+
+/* Any write clears the table */
+static ssize_t adv_arbitration_write(struct file *file,
+				     const char __user *buf, size_t count,
+				     loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct adv_pci_port *port = m->private;
+
+	port->alc_pending = false;
+	memset(port->alc, 0, sizeof(port->alc));
+	port->alc_overflow = 0;
+
+	return count;
+}
+
+static const struct file_operations adv_arbitration_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_arbitration_open,
+	.read = seq_read,
+	.write = adv_arbitration_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static DEFINE_MUTEX(adv_tx_limit_lock);
+
+static struct adv_tx_limit *adv_tx_limit_find(struct adv_pci_port *port,
+					      canid_t id)
+{
+	struct adv_tx_limit *l;
+
+	hash_for_each_possible(port->tx_limits, l, node, id)
+		if (l->id == id)
+			return l;
+
+	return NULL;
+}
+
+static void adv_tx_limit_del(struct adv_pci_port *port,
+			     struct adv_tx_limit *l)
+{
+	hash_del_rcu(&l->node);
+	port->tx_limit_count--;
+	kfree_rcu(l, rcu);
+}
+
+static int adv_parse_id(const char *s, canid_t *id)
+{
+	u32 val;
+
+	if (kstrtou32(s, 0, &val) || val > CAN_EFF_MASK)
+		return -EINVAL;
+	*id = val > CAN_SFF_MASK ? val | CAN_EFF_FLAG : val;
+
+	return 0;
+}
+
+/* "<id> <rate> <burst> [drop]", "del <id>" or "clear" */
+static int adv_tx_limit_command(struct adv_pci_port *port, char *line)
+{
+	struct adv_tx_limit *l, *old;
+	struct hlist_node *tmp;
+	char ids[16], action[8] = "drop";
+	u32 rate, burst;
+	canid_t id;
+	int n, i;
+
+	if (!*line)
+		return 0;
+
+	if (!strcmp(line, "clear")) {
+		hash_for_each_safe(port->tx_limits, i, tmp, l, node)
+			adv_tx_limit_del(port, l);
+		return 0;
+	}
+
+	if (sscanf(line, "del %15s", ids) == 1) {
+		if (adv_parse_id(ids, &id))
+			return -EINVAL;
+		l = adv_tx_limit_find(port, id);
+		if (!l)
+			return -ENOENT;
+		adv_tx_limit_del(port, l);
+		return 0;
+	}
+
+	n = sscanf(line, "%15s %u %u %7s", ids, &rate, &burst, action);
+	if (n < 3 || adv_parse_id(ids, &id) || !rate || !burst)
+		return -EINVAL;
+	if (strcmp(action, "drop"))
+		return -EINVAL;
+
+	l = kzalloc_node(sizeof(*l), GFP_KERNEL, port->card->node);
+	if (!l)
+		return -ENOMEM;
+	l->id = id;
+	l->rate = rate;
+	l->burst = burst;
+	l->interval_ns = div_u64(NSEC_PER_SEC, rate);
+
+	old = adv_tx_limit_find(port, id);
+	if (old)
+		adv_tx_limit_del(port, old);
+	hash_add_rcu(port->tx_limits, &l->node, id);
+	port->tx_limit_count++;
+
+	return 0;
+}
+
+static int adv_tx_limits_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	struct adv_tx_limit *l;
+	int i;
+
+	seq_printf(m, "%8s %10s %6s %12s %12s\n", "id", "rate", "burst",
+		   "passed", "dropped");
+
+	mutex_lock(&adv_tx_limit_lock);
+	hash_for_each(port->tx_limits, i, l, node) {
+		if (l->id & CAN_EFF_FLAG)
+			seq_printf(m, "%08x", l->id & CAN_EFF_MASK);
+		else
+			seq_printf(m, "%8x", l->id);
+		seq_printf(m, " %10u %6u %12llu %12llu\n", l->rate, l->burst,
+			   l->passed, l->dropped);
+	}
+	mutex_unlock(&adv_tx_limit_lock);
+
+	return 0;
+}
+
+static int adv_tx_limits_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_tx_limits_show, inode->i_private);
+}
+
+static ssize_t adv_tx_limits_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	return adv_command_write(file, buf, count, &adv_tx_limit_lock,
+				 adv_tx_limit_command);
+}
+
+static const struct file_operations adv_tx_limits_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_tx_limits_open,
+	.read = seq_read,
+	.write = adv_tx_limits_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void adv_rx_filters_set(struct adv_pci_port *port,
+			       struct adv_rx_filters *f)
+{
+	struct adv_rx_filters *old;
+
+	old = rcu_dereference_protected(port->rx_filters,
+					lockdep_is_held(&adv_rx_hook_lock));
+	rcu_assign_pointer(port->rx_filters, f);
+	adv_rx_update_hooks(port);
+	if (old)
+		kfree_rcu(old, rcu);
+}
+
+/* Payload value and mask as hex bytes, from byte 0 on */
+static int adv_parse_payload(const char *s, u64 *val)
+{
+	u8 buf[CAN_MAX_DLEN] = { 0 };
+	size_t len = strlen(s);
+
+	if (!len || len & 1 || len > 2 * CAN_MAX_DLEN)
+		return -EINVAL;
+	if (hex2bin(buf, s, len / 2))
+		return -EINVAL;
+	memcpy(val, buf, sizeof(*val));
+
+	return 0;
+}
+
+/* "<id>/<mask> <data>/<mask>" adds a rule, "clear" removes all */
+static int adv_rx_filter_command(struct adv_pci_port *port, char *line)
+{
+	char ids[16], masks[16], data[17], datamask[17];
+	struct adv_rx_filters *f, *old;
+	struct adv_rx_filter r;
+
+	if (!*line)
+		return 0;
+
+	if (!strcmp(line, "clear")) {
+		adv_rx_filters_set(port, NULL);
+		return 0;
+	}
+
+	if (sscanf(line, "%15[^/]/%15s %16[^/]/%16s", ids, masks, data,
+		   datamask) != 4)
+		return -EINVAL;
+	if (adv_parse_id(ids, &r.id) || kstrtou32(masks, 0, &r.id_mask) ||
+	    adv_parse_payload(data, &r.data) ||
+	    adv_parse_payload(datamask, &r.data_mask))
+		return -EINVAL;
+	r.id_mask = (r.id_mask & CAN_EFF_MASK) | CAN_EFF_FLAG;
+
+	old = rcu_dereference_protected(port->rx_filters,
+					lockdep_is_held(&adv_rx_hook_lock));
+	if (old && old->count == ADV_RX_FILTERS)
+		return -ENOSPC;
+
+	f = kzalloc_node(sizeof(*f), GFP_KERNEL, port->card->node);
+	if (!f)
+		return -ENOMEM;
+	if (old)
+		memcpy(f->rule, old->rule, old->count * sizeof(r));
+	f->count = old ? old->count : 0;
+	f->rule[f->count++] = r;
+	adv_rx_filters_set(port, f);
+
+	return 0;
+}
+
+static int adv_rx_filters_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	const struct adv_rx_filters *f;
+	const struct adv_rx_filter *r;
+	unsigned int i;
+
+	mutex_lock(&adv_rx_hook_lock);
+	f = rcu_dereference_protected(port->rx_filters,
+				      lockdep_is_held(&adv_rx_hook_lock));
+	for (i = 0; f && i < f->count; i++) {
+		r = &f->rule[i];
+		seq_printf(m, "%x/%x %8phN/%8phN\n", r->id & CAN_EFF_MASK,
+			   r->id_mask & CAN_EFF_MASK, &r->data, &r->data_mask);
+	}
+	mutex_unlock(&adv_rx_hook_lock);
+
+	seq_printf(m, "pass %llu\n", port->filter_pass);
+	seq_printf(m, "drop %llu\n", port->filter_drop);
+
+	return 0;
+}
+
+static int adv_rx_filters_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_rx_filters_show, inode->i_private);
+}
+
+static ssize_t adv_rx_filters_write(struct file *file,
+				    const char __user *buf, size_t count,
+				    loff_t *ppos)
+{
+	return adv_command_write(file, buf, count, &adv_rx_hook_lock,
+				 adv_rx_filter_command);
+}
+
+static const struct file_operations adv_rx_filters_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_rx_filters_open,
+	.read = seq_read,
+	.write = adv_rx_filters_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int adv_lv_alloc(struct adv_pci_port *port)
+{
+	if (!port->lv_table)
+		port->lv_table = vmalloc_user(sizeof(*port->lv_table));
+
+	return port->lv_table ? 0 : -ENOMEM;
+}
+
+/* The interrupt handler may still write an entry through a removed
+ * subscription, so an index is reused only after a grace period.
+ */
+static void adv_lv_clear(struct adv_pci_port *port)
+{
+	struct adv_lv_sub *sub;
+	struct hlist_node *tmp;
+	int i;
+
+	if (!port->lv_table)
+		return;
+
+	port->lv_table->nr_entries = 0;
+	adv_rx_update_hooks(port);
+	hash_for_each_safe(port->lv_subs, i, tmp, sub, node) {
+		hash_del_rcu(&sub->node);
+		kfree_rcu(sub, rcu);
+	}
+	synchronize_rcu();
+}
+
+/* The entry of a removed identifier is marked free for reuse, the table
+ * only shrinks from its end.
+ */
+static int adv_lv_del(struct adv_pci_port *port, canid_t id)
+{
+	struct adv_can_lv_table *t = port->lv_table;
+	struct adv_can_lv_entry *e;
+	struct adv_lv_sub *sub;
+
+	if (!t)
+		return -ENOENT;
+
+	hash_for_each_possible(port->lv_subs, sub, node, id)
+		if (sub->id == id)
+			break;
+	if (!sub)
+		return -ENOENT;
+
+	hash_del_rcu(&sub->node);
+	synchronize_rcu();
+
+	e = &t->entry[sub->index];
+	e->seq++;
+	smp_wmb();
+	e->flags = ADV_CAN_F_FREE;
+	e->count = 0;
+	smp_wmb();
+	e->seq++;
+	kfree(sub);
+
+	while (t->nr_entries &&
+	       (t->entry[t->nr_entries - 1].flags & ADV_CAN_F_FREE))
+		t->nr_entries--;
+	adv_rx_update_hooks(port);
+
+	return 0;
+}
+
+/* "<id> [only]" subscribes an identifier, "del <id>" removes it and
+ * "clear" removes all.
+ */
+static int adv_lv_command(struct adv_pci_port *port, char *line)
+{
+	struct adv_can_lv_table *t;
+	struct adv_can_lv_entry *e;
+	struct adv_lv_sub *sub;
+	char ids[16], opt[8] = "";
+	unsigned int index;
+	canid_t id;
+	int err;
+
+	if (!*line)
+		return 0;
+
+	if (!strcmp(line, "clear")) {
+		adv_lv_clear(port);
+		return 0;
+	}
+
+	if (sscanf(line, "del %15s", ids) == 1) {
+		if (adv_parse_id(ids, &id))
+			return -EINVAL;
+		return adv_lv_del(port, id);
+	}
+
+	if (sscanf(line, "%15s %7s", ids, opt) < 1 || adv_parse_id(ids, &id))
+		return -EINVAL;
+	if (*opt && strcmp(opt, "only"))
+		return -EINVAL;
+
+	err = adv_lv_alloc(port);
+	if (err)
+		return err;
+	t = port->lv_table;
+
+	hash_for_each_possible(port->lv_subs, sub, node, id)
+		if (sub->id == id)
+			return -EEXIST;
+	for (index = 0; index < t->nr_entries; index++)
+		if (t->entry[index].flags & ADV_CAN_F_FREE)
+			break;
+	if (index == ADV_CAN_LV_ENTRIES)
+		return -ENOSPC;
+
+	sub = kzalloc_node(sizeof(*sub), GFP_KERNEL, port->card->node);
+	if (!sub)
+		return -ENOMEM;
+	sub->id = id;
+	sub->index = index;
+	sub->only = *opt;
+
+	/* A free entry may be read while it is set up */
+	e = &t->entry[index];
+	e->seq++;
+	smp_wmb();
+	e->can_id = id & CAN_EFF_MASK;
+	e->timestamp_ns = 0;
+	e->count = 0;
+	e->flags = id & CAN_EFF_FLAG ? ADV_CAN_F_EFF : 0;
+	e->dlc = 0;
+	memset(e->data, 0, sizeof(e->data));
+	smp_wmb();
+	e->seq++;
+	hash_add_rcu(port->lv_subs, &sub->node, id);
+	if (index == t->nr_entries) {
+		smp_wmb();
+		t->nr_entries++;
+	}
+	adv_rx_update_hooks(port);
+
+	return 0;
+}
+
+static int adv_lv_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	struct adv_can_lv_entry *e;
+	u64 now = ktime_get_ns();
+	unsigned int i;
+
+	seq_printf(m, "%8s %10s %10s %3s %s\n", "id", "count", "age_ms",
+		   "dlc", "data");
+
+	mutex_lock(&adv_rx_hook_lock);
+	for (i = 0; port->lv_table && i < port->lv_table->nr_entries; i++) {
+		e = &port->lv_table->entry[i];
+		if (e->flags & ADV_CAN_F_FREE)
+			continue;
+		if (e->flags & ADV_CAN_F_EFF)
+			seq_printf(m, "%08x", e->can_id);
+		else
+			seq_printf(m, "%8x", e->can_id);
+		seq_printf(m, " %10u", e->count);
+		if (e->count)
+			seq_printf(m, " %10llu %3u %*phN\n",
+				   div_u64(now - e->timestamp_ns,
+					   NSEC_PER_MSEC), e->dlc,
+				   min_t(int, e->dlc, CAN_MAX_DLEN), e->data);
+		else
+			seq_puts(m, "          -\n");
+	}
+	mutex_unlock(&adv_rx_hook_lock);
+
+	return 0;
+}
+
+static int adv_lv_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_lv_show, inode->i_private);
+}
+
+static ssize_t adv_lv_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	return adv_command_write(file, buf, count, &adv_rx_hook_lock,
+				 adv_lv_command);
+}
+
+static const struct file_operations adv_lv_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_lv_open,
+	.read = seq_read,
+	.write = adv_lv_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* The table is mapped read-only from the misc device of the port,
+ * struct adv_can_lv_table.
+ */
+static int adv_lv_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct adv_lv_dev *lv = file->private_data;
+	int err = -ENODEV;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	/* Mapped pages stay after the card is removed, the table does not */
+	mutex_lock(&adv_rx_hook_lock);
+	if (lv->port)
+		err = adv_lv_alloc(lv->port);
+	if (!err)
+		err = remap_vmalloc_range(vma, lv->port->lv_table,
+					  vma->vm_pgoff);
+	mutex_unlock(&adv_rx_hook_lock);
+
+	return err;
+}
+
+static void adv_lv_dev_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct adv_lv_dev, ref));
+}
+
+/* misc_open() holds the misc device lock, which misc_deregister() takes,
+ * so the device is still there.
+ */
+static int adv_lv_dev_open(struct inode *inode, struct file *file)
+{
+	struct adv_lv_dev *lv = container_of(file->private_data,
+					     struct adv_lv_dev, misc);
+
+	kref_get(&lv->ref);
+	file->private_data = lv;
+
+	return 0;
+}
+
+static int adv_lv_dev_release(struct inode *inode, struct file *file)
+{
+	struct adv_lv_dev *lv = file->private_data;
+
+	kref_put(&lv->ref, adv_lv_dev_free);
+
+	return 0;
+}
+
+static const struct file_operations adv_lv_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_lv_dev_open,
+	.release = adv_lv_dev_release,
+	.mmap = adv_lv_mmap,
+	.llseek = noop_llseek,
+};
+
+/* /dev/advcan<card>.<port> */
+static int adv_lv_dev_add(struct adv_pci_port *port)
+{
+	struct adv_lv_dev *lv;
+	int err;
+
+	lv = kzalloc_node(sizeof(*lv), GFP_KERNEL, port->card->node);
+	if (!lv)
+		return -ENOMEM;
+
+	snprintf(lv->name, sizeof(lv->name), "advcan%d.%d", port->card->id,
+		 port->index);
+	lv->misc.minor = MISC_DYNAMIC_MINOR;
+	lv->misc.name = lv->name;
+	lv->misc.fops = &adv_lv_dev_fops;
+	lv->misc.parent = &port->card->pdev->dev;
+	kref_init(&lv->ref);
+	lv->port = port;
+
+	err = misc_register(&lv->misc);
+	if (err) {
+		kfree(lv);
+		return err;
+	}
+	port->lv_dev = lv;
+
+	return 0;
+}
+
+static void adv_lv_dev_remove(struct adv_pci_port *port)
+{
+	struct adv_lv_dev *lv = port->lv_dev;
+
+	misc_deregister(&lv->misc);
+	mutex_lock(&adv_rx_hook_lock);
+	lv->port = NULL;
+	mutex_unlock(&adv_rx_hook_lock);
+	kref_put(&lv->ref, adv_lv_dev_free);
+	port->lv_dev = NULL;
+}
+
+/* "<id>" or "<first>-<last>" adds a range, "clear" removes all */
+static int adv_rx_prio_command(struct adv_pci_port *port, char *line)
+{
+	struct adv_rx_prio *p, *old;
+	char *last;
+	canid_t first_id, last_id;
+
+	if (!*line)
+		return 0;
+
+	old = rcu_dereference_protected(port->rx_prio,
+					lockdep_is_held(&adv_rx_hook_lock));
+
+	if (!strcmp(line, "clear")) {
+		p = NULL;
+	} else {
+		last = strchr(line, '-');
+		if (last)
+			*last++ = '\0';
+		if (adv_parse_id(line, &first_id) ||
+		    adv_parse_id(last ? last : line, &last_id) ||
+		    last_id < first_id)
+			return -EINVAL;
+		if (old && old->count == ADV_RX_PRIO_RANGES)
+			return -ENOSPC;
+
+		p = kzalloc_node(sizeof(*p), GFP_KERNEL, port->card->node);
+		if (!p)
+			return -ENOMEM;
+		if (old)
+			*p = *old;
+		p->range[p->count].first = first_id;
+		p->range[p->count].last = last_id;
+		p->count++;
+	}
+
+	rcu_assign_pointer(port->rx_prio, p);
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return 0;
+}
+
+static int adv_rx_prio_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	const struct adv_rx_prio *p;
+	unsigned int i;
+
+	mutex_lock(&adv_rx_hook_lock);
+	p = rcu_dereference_protected(port->rx_prio,
+				      lockdep_is_held(&adv_rx_hook_lock));
+	for (i = 0; p && i < p->count; i++)
+		seq_printf(m, "%x-%x\n", p->range[i].first & CAN_EFF_MASK,
+			   p->range[i].last & CAN_EFF_MASK);
+	mutex_unlock(&adv_rx_hook_lock);
+
+	seq_printf(m, "high_kept %llu\n", port->prio_high_kept);
+	seq_printf(m, "low_dropped %llu\n", port->prio_low_dropped);
+	seq_printf(m, "high_backlog_dropped %llu\n",
+		   port->prio_high_backlog_dropped);
+	seq_printf(m, "low_backlog_dropped %llu\n",
+		   port->prio_low_backlog_dropped);
+	seq_printf(m, "fast_lane %llu\n", port->fast_lane);
+
+	return 0;
+}
+
+static int adv_rx_prio_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_rx_prio_show, inode->i_private);
+}
+
+static ssize_t adv_rx_prio_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
+	return adv_command_write(file, buf, count, &adv_rx_hook_lock,
+				 adv_rx_prio_command);
+}
+
+static const struct file_operations adv_rx_prio_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_rx_prio_open,
+	.read = seq_read,
+	.write = adv_rx_prio_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* "<rx_id> <tx_id> <bs> <stmin> [<pad>]" adds a responder, "del <rx_id>"
+ * removes one and "clear" all. With pad the flow control frame is padded
+ * to 8 bytes.
+ */
+static int adv_isotp_fc_command(struct adv_pci_port *port, char *line)
+{
+	unsigned int bs, stmin, pad = 0, i;
+	char rxs[16], txs[16], pads[8];
+	struct adv_isotp_fc *f, *old;
+	canid_t rx_id, tx_id;
+	struct can_frame *fc;
+	bool del;
+	int n;
+
+	if (!*line)
+		return 0;
+
+	old = rcu_dereference_protected(port->isotp_fc,
+					lockdep_is_held(&adv_rx_hook_lock));
+	if (!strcmp(line, "clear")) {
+		f = NULL;
+		goto replace;
+	}
+
+	del = sscanf(line, "del %15s", rxs) == 1;
+	if (del) {
+		if (adv_parse_id(rxs, &rx_id))
+			return -EINVAL;
+	} else {
+		n = sscanf(line, "%15s %15s %u %u %7s", rxs, txs, &bs, &stmin,
+			   pads);
+		if (n < 4 || adv_parse_id(rxs, &rx_id) ||
+		    adv_parse_id(txs, &tx_id) || bs > 0xff || stmin > 0xff)
+			return -EINVAL;
+		if (n == 5 && (kstrtouint(pads, 0, &pad) || pad > 0xff))
+			return -EINVAL;
+	}
+
+	f = kzalloc_node(sizeof(*f), GFP_KERNEL, port->card->node);
+	if (!f)
+		return -ENOMEM;
+
+	for (i = 0; old && i < old->count; i++)
+		if (old->resp[i].rx_id != rx_id)
+			f->resp[f->count++] = old->resp[i];
+
+	if (!del) {
+		if (f->count == ADV_ISOTP_FC) {
+			kfree(f);
+			return -ENOSPC;
+		}
+
+		f->resp[f->count].rx_id = rx_id;
+		fc = &f->resp[f->count].fc;
+		fc->can_id = tx_id;
+		fc->data[0] = 0x30;	/* flow control, continue to send */
+		fc->data[1] = bs;
+		fc->data[2] = stmin;
+		fc->can_dlc = 3;
+		if (n == 5) {
+			memset(&fc->data[3], pad, CAN_MAX_DLEN - 3);
+			fc->can_dlc = CAN_MAX_DLEN;
+		}
+		f->count++;
+	}
+
+replace:
+	rcu_assign_pointer(port->isotp_fc, f);
+	adv_rx_update_hooks(port);
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return 0;
+}
+
+static int adv_isotp_fc_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+	const struct adv_isotp_fc *f;
+	const struct can_frame *fc;
+	unsigned int i;
+
+	mutex_lock(&adv_rx_hook_lock);
+	f = rcu_dereference_protected(port->isotp_fc,
+				      lockdep_is_held(&adv_rx_hook_lock));
+	for (i = 0; f && i < f->count; i++) {
+		fc = &f->resp[i].fc;
+		seq_printf(m, "%x %x %u %u %*phN\n",
+			   f->resp[i].rx_id & CAN_EFF_MASK,
+			   fc->can_id & CAN_EFF_MASK, fc->data[1], fc->data[2],
+			   fc->can_dlc, fc->data);
+	}
+	mutex_unlock(&adv_rx_hook_lock);
+
+	seq_printf(m, "sent %llu\n", port->fc_sent);
+	seq_printf(m, "deferred %llu\n", port->fc_deferred);
+	seq_printf(m, "overflow %llu\n", port->fc_overflow);
+
+	return 0;
+}
+
+static int adv_isotp_fc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_isotp_fc_show, inode->i_private);
+}
+
+static ssize_t adv_isotp_fc_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	return adv_command_write(file, buf, count, &adv_rx_hook_lock,
+				 adv_isotp_fc_command);
+}
+
+static const struct file_operations adv_isotp_fc_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_isotp_fc_open,
+	.read = seq_read,
+	.write = adv_isotp_fc_write,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
 
-/* SJA1000 internal clock is divided by 2 from external clock */
-#define ADV_PCI_CAN_CLOCK (16000000 / 2)
+#ifdef ADV_RX_BPF
+static int adv_rx_bpf_attach(struct adv_pci_port *port, int fd)
+{
+	struct bpf_prog *prog = NULL, *old;
+	struct sk_buff *skb;
 
-/* The board configuration is following:
- * RX1 is connected to ground.
- * TX1 is not connected, but we do not leave it floating.
- * CLKO forwards clock to PCI bridge.
- */
-#define ADV_PCI_OCR         (OCR_TX0_PUSHPULL | OCR_TX1_PUSHPULL)
+	if (fd >= 0) {
+		prog = bpf_prog_get_type(fd, BPF_PROG_TYPE_SOCKET_FILTER);
+		if (IS_ERR(prog))
+			return PTR_ERR(prog);
+	}
 
-/* In the CDR register, enable comparator by-pass for lower latency
- * since we have external tranceiver.
- * The clock divider value is set for direct oscillator output because the
- * PCI bridge is driven by the second CLKOUT output.
- */
-#define ADV_PCI_CDR             (CDR_CBP | CDR_CLKOUT_MASK)
+	mutex_lock(&adv_rx_hook_lock);
+	if (prog && !port->rx_prog_skb) {
+		skb = __alloc_skb(sizeof(struct adv_can_rx_ctx), GFP_KERNEL,
+				  0, port->card->node);
+		if (!skb) {
+			mutex_unlock(&adv_rx_hook_lock);
+			bpf_prog_put(prog);
+			return -ENOMEM;
+		}
+		memset(skb_put(skb, sizeof(struct adv_can_rx_ctx)), 0,
+		       sizeof(struct adv_can_rx_ctx));
+		port->rx_prog_skb = skb;
+	}
+	old = rcu_dereference_protected(port->rx_prog,
+					lockdep_is_held(&adv_rx_hook_lock));
+	rcu_assign_pointer(port->rx_prog, prog);
+	adv_rx_update_hooks(port);
+	mutex_unlock(&adv_rx_hook_lock);
 
-static const struct pci_device_id adv_pci_tbl[] = {
-	/* PCI BAR 0 iomem 0x400 bytes per port 32-bit word for each reg */
-	{ PCI_VDEVICE(ADVANTECH, 0xc201) },
-	{ PCI_VDEVICE(ADVANTECH, 0xc202) },
-	{ PCI_VDEVICE(ADVANTECH, 0xc204) },
-	{ PCI_VDEVICE(ADVANTECH, 0xc301) },
-	{ PCI_VDEVICE(ADVANTECH, 0xc302) }, /* MIOe-3680 */
-	{ PCI_VDEVICE(ADVANTECH, 0xc304) },
-	{ 0, }
+	if (old) {
+		synchronize_rcu();
+		bpf_prog_put(old);
+	}
+
+	return 0;
+}
+
+static int adv_rx_bpf_show(struct seq_file *m, void *v)
+{
+	struct adv_pci_port *port = m->private;
+
+	seq_printf(m, "attached %d\n",
+		   rcu_access_pointer(port->rx_prog) != NULL);
+	seq_printf(m, "pass %llu\n", port->bpf_pass);
+	seq_printf(m, "drop %llu\n", port->bpf_drop);
+	seq_printf(m, "redirect %llu\n", port->bpf_redirect);
+	seq_printf(m, "redirect_err %llu\n", port->bpf_redirect_err);
+
+	return 0;
+}
+
+static int adv_rx_bpf_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, adv_rx_bpf_show, inode->i_private);
+}
+
+/* Write a program fd to attach, "detach" or -1 to detach */
+static ssize_t adv_rx_bpf_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	char buf[16];
+	int fd, err;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	strim(buf);
+
+	if (!strcmp(buf, "detach"))
+		fd = -1;
+	else if (kstrtoint(buf, 0, &fd))
+		return -EINVAL;
+
+	err = adv_rx_bpf_attach(m->private, fd);
+
+	return err ? err : count;
+}
+
+static const struct file_operations adv_rx_bpf_fops = {
+	.owner = THIS_MODULE,
+	.open = adv_rx_bpf_open,
+	.read = seq_read,
+	.write = adv_rx_bpf_write,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
-MODULE_DEVICE_TABLE(pci, adv_pci_tbl);
+#endif
+
+static void adv_debugfs_init(struct adv_pci_card *card)
+{
+	struct adv_pci_port *port;
+	char name[8];
+	int i;
+
+	card->debugfs = debugfs_create_dir(pci_name(card->pdev),
+					   adv_debugfs_root);
+	if (IS_ERR_OR_NULL(card->debugfs))
+		return;
+
+	debugfs_create_file("isr_duration", 0600, card->debugfs,
+			    card->isr_hist, &adv_hist_fops);
+	debugfs_create_file("rx_delivery", 0600, card->debugfs,
+			    card->rx_hist, &adv_hist_fops);
+	if (irq_thread)
+		debugfs_create_file("thread_duration", 0600, card->debugfs,
+				    card->thread_hist, &adv_hist_fops);
+	debugfs_create_file("isr_max", 0600, card->debugfs, card,
+			    &adv_isr_max_fops);
+	debugfs_create_u64("foreign_irqs", 0400, card->debugfs,
+			   &card->foreign_irqs);
+
+	for (i = 0; i < card->nr_ports; i++) {
+		port = &card->port[i];
+		snprintf(name, sizeof(name), "port%d", i);
+		port->debugfs = debugfs_create_dir(name, card->debugfs);
+		debugfs_create_file("isr_duration", 0600, port->debugfs,
+				    port->isr_hist, &adv_hist_fops);
+		debugfs_create_file("rx_delivery", 0600, port->debugfs,
+				    port->rx_hist, &adv_hist_fops);
+		debugfs_create_file("pktgen", 0600, port->debugfs, port,
+				    &adv_pktgen_fops);
+		debugfs_create_u64("stalls", 0400, port->debugfs,
+				   &port->stalls);
+		debugfs_create_file("mode", 0600, port->debugfs, port,
+				    &adv_mode_fops);
+		debugfs_create_file("bus_health", 0600, port->debugfs, port,
+				    &adv_bus_health_fops);
+		debugfs_create_file("arbitration", 0600, port->debugfs, port,
+				    &adv_arbitration_fops);
+		debugfs_create_file("tx_id_limits", 0600, port->debugfs, port,
+				    &adv_tx_limits_fops);
+		debugfs_create_file("rx_filters", 0600, port->debugfs, port,
+				    &adv_rx_filters_fops);
+		debugfs_create_file("latest", 0600, port->debugfs, port,
+				    &adv_lv_fops);
+		debugfs_create_file("rx_priority", 0600, port->debugfs, port,
+				    &adv_rx_prio_fops);
+		debugfs_create_file("isotp_fc", 0600, port->debugfs, port,
+				    &adv_isotp_fc_fops);
+#ifdef ADV_RX_BPF
+		debugfs_create_file("rx_bpf", 0600, port->debugfs, port,
+				    &adv_rx_bpf_fops);
+#endif
+	}
+}
+
+/* Port settings in sysfs, in the advantech group of the net device */
+
+static ssize_t adv_ewl_show(struct device *d, struct device_attribute *attr,
+			    char *buf)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+
+	return sprintf(buf, "%u\n", port->ewl);
+}
+
+/* The register is writable only in reset mode, so while the port is down */
+static ssize_t adv_ewl_store(struct device *d, struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct net_device *dev = to_net_dev(d);
+	struct sja1000_priv *priv = netdev_priv(dev);
+	struct adv_pci_port *port = priv->priv;
+	u8 val;
+	int err;
+
+	err = kstrtou8(buf, 0, &val);
+	if (err)
+		return err;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	if (netif_running(dev)) {
+		err = -EBUSY;
+	} else {
+		port->ewl = val;
+		priv->write_reg(priv, SJA1000_EWL, val);
+	}
+	rtnl_unlock();
+
+	return err ? err : count;
+}
+
+static ssize_t adv_err_warn_show(struct device *d,
+				 struct device_attribute *attr, char *buf)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+
+	return sprintf(buf, "%u\n", port->err_warn);
+}
+
+static ssize_t adv_err_warn_store(struct device *d,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+	int err;
+
+	err = kstrtou8(buf, 0, &port->err_warn);
+
+	return err ? err : count;
+}
+
+static ssize_t adv_tx_load_limit_show(struct device *d,
+				      struct device_attribute *attr, char *buf)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+
+	return sprintf(buf, "%u\n", port->tx_load_limit);
+}
+
+static ssize_t adv_tx_load_limit_store(struct device *d,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+	u8 val;
+	int err;
+
+	err = kstrtou8(buf, 0, &val);
+	if (err)
+		return err;
+	if (val > 100)
+		return -EINVAL;
+
+	port->tx_load_limit = val == 100 ? 0 : val;
+
+	return count;
+}
+
+static ssize_t adv_rx_watermark_show(struct device *d,
+				     struct device_attribute *attr, char *buf)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+
+	return sprintf(buf, "%u\n", port->rx_watermark);
+}
+
+static ssize_t adv_rx_watermark_store(struct device *d,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+	u8 val;
+	int err;
+
+	err = kstrtou8(buf, 0, &val);
+	if (err)
+		return err;
+	if (val > 100)
+		return -EINVAL;
+
+	mutex_lock(&adv_rx_hook_lock);
+	port->rx_watermark = val;
+	adv_rx_update_hooks(port);
+	mutex_unlock(&adv_rx_hook_lock);
+
+	return count;
+}
+
+static ssize_t adv_rx_fast_lane_show(struct device *d,
+				     struct device_attribute *attr, char *buf)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+
+	return sprintf(buf, "%u\n", port->rx_fast_lane);
+}
+
+static ssize_t adv_rx_fast_lane_store(struct device *d,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+	u8 val;
+	int err;
+
+	err = kstrtou8(buf, 0, &val);
+	if (err)
+		return err;
+
+	mutex_lock(&adv_rx_hook_lock);
+	port->rx_fast_lane = val;
+	adv_rx_update_hooks(port);
+	mutex_unlock(&adv_rx_hook_lock);
+
+	return count;
+}
+
+static ssize_t adv_bitrate_show(struct device *d,
+				struct device_attribute *attr, char *buf)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+
+	return sprintf(buf, "%u\n", priv->can.bittiming.bitrate);
+}
+
+/* Unlike the netlink bitrate, this may be changed while the port is up */
+static ssize_t adv_bitrate_store(struct device *d,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct net_device *dev = to_net_dev(d);
+	struct sja1000_priv *priv = netdev_priv(dev);
+	struct can_bittiming bt;
+	u32 val;
+	int err;
+
+	err = kstrtou32(buf, 0, &val);
+	if (err)
+		return err;
+	err = adv_calc_bittiming(priv, val, &bt);
+	if (err)
+		return err;
+
+	if (!rtnl_trylock())
+		return restart_syscall();
+	if (netif_running(dev)) {
+		err = adv_switch_bitrate(priv->priv, &bt);
+	} else {
+		priv->can.bittiming = bt;
+		adv_write_btr(priv, &bt);
+	}
+	rtnl_unlock();
 
-static u8 adv_read_reg(const struct sja1000_priv *priv, int port)
+	return err ? err : count;
+}
+
+static ssize_t adv_bitrate_switch_ns_show(struct device *d,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	struct sja1000_priv *priv = netdev_priv(to_net_dev(d));
+	struct adv_pci_port *port = priv->priv;
+
+	return sprintf(buf, "%llu\n", port->br_switch_ns);
+}
+
+static DEVICE_ATTR(ewl, 0644, adv_ewl_show, adv_ewl_store);
+static DEVICE_ATTR(err_warn, 0644, adv_err_warn_show, adv_err_warn_store);
+static DEVICE_ATTR(tx_load_limit, 0644, adv_tx_load_limit_show,
+		   adv_tx_load_limit_store);
+static DEVICE_ATTR(rx_watermark, 0644, adv_rx_watermark_show,
+		   adv_rx_watermark_store);
+static DEVICE_ATTR(rx_fast_lane, 0644, adv_rx_fast_lane_show,
+		   adv_rx_fast_lane_store);
+static DEVICE_ATTR(bitrate, 0644, adv_bitrate_show, adv_bitrate_store);
+static DEVICE_ATTR(bitrate_switch_ns, 0444, adv_bitrate_switch_ns_show, NULL);
+
+static struct attribute *adv_port_attrs[] = {
+	&dev_attr_ewl.attr,
+	&dev_attr_err_warn.attr,
+	&dev_attr_tx_load_limit.attr,
+	&dev_attr_rx_watermark.attr,
+	&dev_attr_rx_fast_lane.attr,
+	&dev_attr_bitrate.attr,
+	&dev_attr_bitrate_switch_ns.attr,
+	NULL
+};
+
+static const struct attribute_group adv_port_group = {
+	.name = "advantech",
+	.attrs = adv_port_attrs,
+};
+
+/* Bulk capture device of the card. Its private data is the card. */
+static int adv_cap_open(struct net_device *dev)
+{
+	struct adv_pci_card *card = *(struct adv_pci_card **)netdev_priv(dev);
+	int i;
+
+	mutex_lock(&adv_rx_hook_lock);
+	card->cap_running = true;
+	for (i = 0; i < card->nr_ports; i++)
+		adv_rx_update_hooks(&card->port[i]);
+	mutex_unlock(&adv_rx_hook_lock);
+
+	return 0;
+}
+
+static int adv_cap_stop(struct net_device *dev)
+{
+	struct adv_pci_card *card = *(struct adv_pci_card **)netdev_priv(dev);
+	unsigned long flags;
+	int i;
+
+	mutex_lock(&adv_rx_hook_lock);
+	card->cap_running = false;
+	for (i = 0; i < card->nr_ports; i++)
+		adv_rx_update_hooks(&card->port[i]);
+	mutex_unlock(&adv_rx_hook_lock);
+
+	/* Wait for handlers still adding records */
+	synchronize_irq(card->pdev->irq);
+	if (irq_thread)
+		synchronize_rcu();
+	hrtimer_cancel(&card->cap_timer);
+
+	spin_lock_irqsave(&card->cap_lock, flags);
+	kfree_skb(card->cap_skb);
+	card->cap_skb = NULL;
+	card->cap_count = 0;
+	spin_unlock_irqrestore(&card->cap_lock, flags);
+
+	return 0;
+}
+
+static netdev_tx_t adv_cap_xmit(struct sk_buff *skb, struct net_device *dev)
+{
+	dev->stats.tx_dropped++;
+	kfree_skb(skb);
+
+	return NETDEV_TX_OK;
+}
+
+static const struct net_device_ops adv_cap_ops = {
+	.ndo_open = adv_cap_open,
+	.ndo_stop = adv_cap_stop,
+	.ndo_start_xmit = adv_cap_xmit,
+};
+
+static void adv_cap_setup(struct net_device *dev)
 {
-	return readb(priv->reg_base + 4 * port);
+	dev->type = ARPHRD_NONE;
+	dev->flags = IFF_NOARP;
+	dev->tx_queue_len = 0;
+	dev->mtu = capture_batch * sizeof(struct adv_can_capture_rec);
+	dev->netdev_ops = &adv_cap_ops;
 }
 
-static void adv_write_reg(const struct sja1000_priv *priv, int port, u8 val)
+static int adv_cap_register(struct adv_pci_card *card)
 {
-	writeb(val, priv->reg_base + 4 * port);
+	struct net_device *dev;
+	int err;
+
+	dev = alloc_netdev(sizeof(card), "advcap%d", NET_NAME_UNKNOWN,
+			   adv_cap_setup);
+	if (!dev)
+		return -ENOMEM;
+
+	*(struct adv_pci_card **)netdev_priv(dev) = card;
+	SET_NETDEV_DEV(dev, &card->pdev->dev);
+
+	err = register_netdev(dev);
+	if (err) {
+		free_netdev(dev);
+		return err;
+	}
+	card->cap_dev = dev;
+	netdev_info(dev, "Capture of %d ports\n", card->nr_ports);
+
+	return 0;
 }
 
 static void adv_remove(struct pci_dev *pdev)
 {
 	struct adv_pci_card *card = pci_get_drvdata(pdev);
+	struct adv_pci_port *port;
+	struct adv_tx_limit *l;
+	struct adv_lv_sub *sub;
+	struct hlist_node *tmp;
 	struct net_device *dev;
-	int i = 0;
+	int i = 0, j;
+
+	cancel_delayed_work_sync(&card->watchdog);
+	debugfs_remove_recursive(card->debugfs);
 
-	for (i = 0; i < ARRAY_SIZE(card->net_dev); i++) {
-		dev = card->net_dev[i];
+	if (card->cap_dev) {
+		unregister_netdev(card->cap_dev);
+		free_netdev(card->cap_dev);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(card->port); i++) {
+		if (card->port[i].lv_dev)
+			adv_lv_dev_remove(&card->port[i]);
+		dev = card->port[i].dev;
 		if (dev) {
+			adv_pktgen_stop(&card->port[i]);
 			netdev_info(dev, "Removing\n");
 			unregister_sja1000dev(dev);
-			free_sja1000dev(dev);
+			hrtimer_cancel(&card->port[i].tx_pace_timer);
+		}
+	}
+
+	if (card->irq_requested) {
+		irq_set_affinity_hint(pdev->irq, NULL);
+		free_irq(pdev->irq, card);
+	}
+
+	/* On the interrupt thread list */
+	if (card->list.next) {
+		mutex_lock(&adv_cards_lock);
+		list_del_rcu(&card->list);
+		mutex_unlock(&adv_cards_lock);
+		synchronize_rcu();
+	}
+
+	tasklet_kill(&card->redirect_tasklet);
+	skb_queue_purge(&card->redirect_q);
+
+	for (i = 0; i < ARRAY_SIZE(card->port); i++) {
+		port = &card->port[i];
+		if (port->dev) {
+			tasklet_kill(&port->fast_tasklet);
+			skb_queue_purge(&port->fast_q);
 		}
+#ifdef ADV_RX_BPF
+		if (rcu_access_pointer(port->rx_prog))
+			bpf_prog_put(rcu_dereference_raw(port->rx_prog));
+		kfree_skb(port->rx_prog_skb);
+#endif
+		kfree(rcu_dereference_raw(port->rx_filters));
+		kfree(rcu_dereference_raw(port->rx_prio));
+		kfree(rcu_dereference_raw(port->isotp_fc));
+		hash_for_each_safe(port->lv_subs, j, tmp, sub, node)
+			kfree(sub);
+		vfree(port->lv_table);
+		hash_for_each_safe(port->tx_limits, j, tmp, l, node)
+			kfree(l);
+		if (port->dev)
+			free_sja1000dev(port->dev);
+		free_percpu(port->isr_hist);
+		free_percpu(port->rx_hist);
 	}
+	free_percpu(card->isr_hist);
+	free_percpu(card->thread_hist);
+	free_percpu(card->rx_hist);
+
+	if (card->id >= 0)
+		ida_simple_remove(&adv_card_ida, card->id);
 
 	pci_disable_msi(pdev);
 	pci_iounmap(pdev, card->can_addr);
@@ -109,6 +4884,7 @@ static int adv_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 	struct sja1000_priv *priv;
 	struct net_device *dev;
 	struct adv_pci_card *card;
+	struct adv_pci_port *port;
 	int err, i;
 
 	/* Enabling PCI device */
@@ -117,14 +4893,44 @@ static int adv_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 		return -ENODEV;
 	}
 
-	/* Allocating card structures to hold addresses, ... */
-	card = kzalloc(sizeof(*card), GFP_KERNEL);
+	/* Allocating card structures to hold addresses, ... The ports are
+	 * part of the card, so the interrupt handler state is node local.
+	 */
+	card = kzalloc_node(sizeof(*card), GFP_KERNEL,
+			    dev_to_node(&pdev->dev));
 	if (!card) {
 		pci_disable_device(pdev);
 		return -ENOMEM;
 	}
 
 	pci_set_drvdata(pdev, card);
+	card->pdev = pdev;
+	card->node = dev_to_node(&pdev->dev);
+	skb_queue_head_init(&card->redirect_q);
+	tasklet_init(&card->redirect_tasklet, adv_redirect_tasklet,
+		     (unsigned long)card);
+	INIT_DELAYED_WORK(&card->watchdog, adv_watchdog);
+	spin_lock_init(&card->cap_lock);
+	hrtimer_init(&card->cap_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	card->cap_timer.function = adv_cap_timer;
+
+	card->id = ida_simple_get(&adv_card_ida, 0, 0, GFP_KERNEL);
+	if (card->id < 0) {
+		err = card->id;
+		goto failure_cleanup;
+	}
+
+	/* Number of ports is in the PCI device ID lowest nibble */
+	card->nr_ports = min_t(int, pdev->device & 0xf,
+			       ARRAY_SIZE(card->port));
+
+	card->isr_hist = alloc_percpu(struct adv_hist);
+	card->thread_hist = alloc_percpu(struct adv_hist);
+	card->rx_hist = alloc_percpu(struct adv_hist);
+	if (!card->isr_hist || !card->thread_hist || !card->rx_hist) {
+		err = -ENOMEM;
+		goto failure_cleanup;
+	}
 
 	err = pci_request_region(pdev, 0, DRV_NAME);
 	if (err)
@@ -142,18 +4948,70 @@ static int adv_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 		dev_err(&pdev->dev, "Error %d enabling MSI.\n", err);
 #endif
 
-	/* Number of ports is in the PCI device ID lowest nibble */
-	for (i = 0; i < (pdev->device & 0xf); ++i) {
+	if (irq_thread) {
+		mutex_lock(&adv_cards_lock);
+		list_add_tail_rcu(&card->list, &adv_cards);
+		mutex_unlock(&adv_cards_lock);
+	}
+
+	err = request_irq(pdev->irq,
+			  irq_thread ? adv_interrupt_hard : adv_interrupt,
+			  IRQF_SHARED, DRV_NAME, card);
+	if (err) {
+		dev_err(&pdev->dev, "Requesting irq %d failed\n", pdev->irq);
+		goto failure_cleanup;
+	}
+	card->irq_requested = true;
+
+	/* Serve the interrupt on the node of the card by default */
+	if (irq_thread && irq_thread_cpu >= 0)
+		irq_set_affinity_hint(pdev->irq, cpumask_of(irq_thread_cpu));
+	else if (card->node != NUMA_NO_NODE)
+		irq_set_affinity_hint(pdev->irq, cpumask_of_node(card->node));
+
+	for (i = 0; i < card->nr_ports; ++i) {
+		port = &card->port[i];
+		port->card = card;
+		port->index = i;
+		port->ier = IRQ_OFF;
+		spin_lock_init(&port->ir_lock);
+		spin_lock_init(&port->tx_lock);
+		spin_lock_init(&port->fc_lock);
+		spin_lock_init(&port->mode_lock);
+		mutex_init(&port->pktgen.lock);
+		init_waitqueue_head(&port->pktgen.tx_wait);
+		spin_lock_init(&port->pktgen.stats_lock);
+		port->pktgen.id = 0x123;
+		port->pktgen.dlc = CAN_MAX_DLEN;
+		port->pktgen.burst = 1;
+		hash_init(port->tx_limits);
+		hash_init(port->lv_subs);
+		INIT_LIST_HEAD(&port->rx_cbs);
+		skb_queue_head_init(&port->fast_q);
+		tasklet_init(&port->fast_tasklet, adv_rx_fast_tasklet,
+			     (unsigned long)port);
+		hrtimer_init(&port->tx_pace_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_ABS);
+		port->tx_pace_timer.function = adv_tx_pace_timer;
+		port->ewl = 96;		/* reset value */
+		port->err_warn = 32;
+		port->isr_hist = alloc_percpu(struct adv_hist);
+		port->rx_hist = alloc_percpu(struct adv_hist);
+		if (!port->isr_hist || !port->rx_hist) {
+			err = -ENOMEM;
+			goto failure_cleanup;
+		}
+
 		dev = alloc_sja1000dev(0);
 		if (!dev) {
 			err = -ENOMEM;
 			goto failure_cleanup;
 		}
 
-		card->net_dev[i] = dev;
 		priv = netdev_priv(dev);
-		priv->priv = card;
-		priv->irq_flags = IRQF_SHARED;
+		priv->priv = port;
+		/* The card handler calls sja1000_interrupt() for each port */
+		priv->flags |= SJA1000_CUSTOM_IRQ_HANDLER;
 		dev->irq = pdev->irq;
 		priv->reg_base = card->can_addr + 0x400 * i;
 		priv->read_reg = adv_read_reg;
@@ -161,23 +5019,55 @@ static int adv_probe(struct pci_dev *pdev, const struct pci_device_id *ent)
 		priv->can.clock.freq = ADV_PCI_CAN_CLOCK;
 		priv->ocr = ADV_PCI_OCR;
 		priv->cdr = ADV_PCI_CDR;
+		port->core_set_mode = priv->can.do_set_mode;
+		priv->can.do_set_mode = adv_do_set_mode;
 
 		SET_NETDEV_DEV(dev, &pdev->dev);
 		dev->dev_id = i;
+		dev->ethtool_ops = &adv_ethtool_ops;
+		dev->sysfs_groups[0] = &adv_port_group;
+
+		/* alloc_sja1000dev() installed the core netdev_ops, wrap
+		 * them before the device can be opened
+		 */
+		port->core_ops = dev->netdev_ops;
+		port->netdev_ops = *dev->netdev_ops;
+		port->netdev_ops.ndo_open = adv_open;
+		port->netdev_ops.ndo_stop = adv_stop;
+		port->netdev_ops.ndo_start_xmit = adv_start_xmit;
+		dev->netdev_ops = &port->netdev_ops;
 
-		/* Register SJA1000 device */
+		/* Register SJA1000 device, the ops use port->dev */
+		port->dev = dev;
 		err = register_sja1000dev(dev);
 		if (err) {
 			dev_err(&pdev->dev,
 				"Registering device failed (err=%d)\n", err);
+			port->dev = NULL;
 			free_sja1000dev(dev);
 			goto failure_cleanup;
 		}
 
+		err = adv_lv_dev_add(port);
+		if (err)
+			goto failure_cleanup;
+
 		netdev_info(dev, "Channel #%d at 0x%p, irq %d\n",
 			    i + 1, priv->reg_base, dev->irq);
 	}
 
+	if (capture) {
+		err = adv_cap_register(card);
+		if (err)
+			goto failure_cleanup;
+	}
+
+	adv_debugfs_init(card);
+
+	if (watchdog_ms)
+		schedule_delayed_work(&card->watchdog,
+				      msecs_to_jiffies(watchdog_ms));
+
 	return 0;
 
 failure_cleanup:
@@ -195,4 +5085,45 @@ static struct pci_driver adv_pci_driver = {
 	.remove = adv_remove,
 };
 
-module_pci_driver(adv_pci_driver);
+static int __init adv_init(void)
+{
+	int err;
+
+	capture_batch = clamp_t(unsigned int, capture_batch, 1,
+			      ADV_CAP_BATCH_MAX);
+
+	if (irq_thread) {
+		err = adv_irq_thread_start();
+		if (err)
+			return err;
+	}
+
+	adv_debugfs_root = debugfs_create_dir(DRV_NAME, NULL);
+
+	err = adv_pmu_init();
+	if (err)
+		pr_warn(DRV_NAME ": perf PMU not available (err=%d)\n", err);
+
+	err = pci_register_driver(&adv_pci_driver);
+	if (err) {
+		if (adv_pmu_events)
+			adv_pmu_exit();
+		debugfs_remove_recursive(adv_debugfs_root);
+		if (adv_irq_task)
+			kthread_stop(adv_irq_task);
+	}
+
+	return err;
+}
+module_init(adv_init);
+
+static void __exit adv_exit(void)
+{
+	pci_unregister_driver(&adv_pci_driver);
+	if (adv_pmu_events)
+		adv_pmu_exit();
+	debugfs_remove_recursive(adv_debugfs_root);
+	if (adv_irq_task)
+		kthread_stop(adv_irq_task);
+}
+module_exit(adv_exit);
@@ -0,0 +1,129 @@
+/*
+ * Userspace interface of the advantech_can_pci driver.
+ *
+ * Copyright (C) 2015 Marko Kohtala <marko.kohtala@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADVANTECH_CAN_PCI_H
+#define ADVANTECH_CAN_PCI_H
+
+#include <linux/types.h>
+
+/* Frame flags */
+#define ADV_CAN_F_EFF		0x01	/* 29 bit identifier */
+#define ADV_CAN_F_RTR		0x02	/* remote transmission request */
+#define ADV_CAN_F_FREE		0x80	/* latest value entry not in use */
+
+/* RX eBPF hook, attached by writing a program fd to portN/rx_bpf in
+ * debugfs.
+ *
+ * A BPF_PROG_TYPE_SOCKET_FILTER program runs on each received frame
+ * before the driver allocates an skb for it. The program sees this
+ * structure as the packet data. Multi-byte fields are big-endian like
+ * packet headers, so BPF_LD_ABS loads give host order values.
+ */
+struct adv_can_rx_ctx {
+	__be64 timestamp_ns;	/* CLOCK_MONOTONIC at reception */
+	__be32 can_id;		/* 11 or 29 bit identifier */
+	__u8 port;		/* port number on the card */
+	__u8 flags;		/* ADV_CAN_F_* */
+	__u8 dlc;
+	__u8 reserved;
+	__u8 data[8];
+};
+
+/* RX eBPF program return values */
+#define ADV_RX_DROP		0
+#define ADV_RX_PASS		1
+#define ADV_RX_REDIRECT(port)	(0x100 | (port))	/* TX on same card */
+
+/* Latest value table, mapped read-only from /dev/advcan<card>.<port>.
+ *
+ * Each subscribed identifier has an entry holding its last received
+ * frame. The entry of a removed identifier has ADV_CAN_F_FREE set until
+ * a new subscription takes it. The driver makes seq odd while it writes
+ * an entry, so a reader copies the entry between two reads of seq and
+ * retries when seq was odd or changed. Fields are in host byte order.
+ */
+#define ADV_CAN_LV_ENTRIES	511
+
+struct adv_can_lv_entry {
+	__u32 seq;
+	__u32 can_id;		/* 11 or 29 bit identifier */
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC at reception */
+	__u32 count;		/* frames received */
+	__u8 flags;		/* ADV_CAN_F_* */
+	__u8 dlc;
+	__u8 reserved[2];
+	__u8 data[8];
+};
+
+struct adv_can_lv_table {
+	__u32 nr_entries;	/* subscribed identifiers */
+	__u32 reserved[7];
+	struct adv_can_lv_entry entry[ADV_CAN_LV_ENTRIES];
+};
+
+/* Bulk capture, enabled with the capture module parameter.
+ *
+ * Each card then has a network device advcapN showing the frames
+ * received on all its ports. A packet on it is an array of records,
+ * sent after capture_batch frames or capture_timeout_us from the first
+ * frame in it. The packets have protocol ADV_CAN_CAPTURE_PROTO and are
+ * read with a packet socket; CAN sockets never see them. Fields are in
+ * host byte order.
+ */
+#define ADV_CAN_CAPTURE_PROTO	0x88b5	/* experimental ethertype */
+
+struct adv_can_capture_rec {
+	__u64 timestamp_ns;	/* CLOCK_MONOTONIC at reception */
+	__u32 can_id;		/* with flags as in struct can_frame */
+	__u8 port;		/* port number on the card */
+	__u8 dlc;
+	__u8 reserved[2];
+	__u8 data[8];
+};
+
+#ifdef __KERNEL__
+#include <linux/can.h>
+
+struct net_device;
+struct adv_can_rx_hook;
+
+/* In-kernel consumers
+ *
+ * The callback runs in the interrupt handler of the port for each
+ * received frame matching id and mask, before an skb is allocated.
+ * Returning true consumes the frame, false also passes it to the stack.
+ * Registering holds a reference to the net device, so users must
+ * unregister on NETDEV_UNREGISTER.
+ *
+ * adv_can_xmit() writes a frame straight to the transmit buffer, also
+ * from the callback. The frame is subject to the pacing and identifier
+ * limits of the port. It returns -EBUSY when the buffer is in use or
+ * the frame is not yet due, -ENOBUFS when the identifier is over its
+ * limit. The frame is not echoed to local sockets.
+ */
+typedef bool (*adv_can_rx_fn)(void *data, const struct can_frame *cf,
+			      u64 timestamp_ns);
+
+struct adv_can_rx_hook *adv_can_rx_register(struct net_device *dev,
+					    canid_t id, canid_t mask,
+					    adv_can_rx_fn fn, void *data);
+void adv_can_rx_unregister(struct adv_can_rx_hook *hook);
+int adv_can_xmit(struct net_device *dev, const struct can_frame *cf);
+#endif
+
+#endif /* ADVANTECH_CAN_PCI_H */
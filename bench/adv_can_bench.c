@@ -0,0 +1,814 @@
+/*
+ * Benchmark for SocketCAN interfaces of the advantech_can_pci driver.
+ *
+ * Copyright (C) 2015 Marko Kohtala <marko.kohtala@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the version 2 of the GNU General Public License
+ * as published by the Free Software Foundation
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs standard scenarios over the interfaces given with -i, which are
+ * expected to be on the same bus (or all the same vcan interface), and
+ * prints the results as JSON.
+ *
+ * Every frame carries the index of the sending interface in its
+ * identifier and a sequence number and send time in its payload when
+ * the DLC allows. Receivers count only frames sent from other
+ * interfaces of the list.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#define MAX_IFACES	8
+#define MAX_SAMPLES	(16 * 1024 * 1024)
+#define BENCH_ID_BASE	0x100	/* plus interface index */
+
+struct bench;
+
+struct iface {
+	struct bench *bench;
+	int index;
+	char name[IFNAMSIZ];
+	int tx_sock;
+	int rx_sock;
+	pthread_t tx_thread;
+	pthread_t rx_thread;
+
+	uint64_t tx_frames;
+	uint64_t tx_rejected;	/* ENOBUFS from a full queue */
+	uint64_t rx_frames;
+	uint64_t rx_seq_gaps;
+	uint32_t next_seq[MAX_IFACES];
+
+	uint32_t *lat_ns;	/* receive latency samples */
+	size_t nr_lat;
+
+	/* Interface statistics at start and end of the run */
+	uint64_t stats_start[4];
+	uint64_t stats_end[4];
+};
+
+static const char *const iface_stats[] = {
+	"rx_over_errors",
+	"rx_fifo_errors",
+	"rx_dropped",
+	"tx_dropped",
+};
+
+struct cpu_sample {
+	struct rusage self;
+	uint64_t stat[8];	/* user nice system idle iowait irq softirq steal */
+};
+
+struct bench {
+	const char *scenario;
+	struct iface iface[MAX_IFACES];
+	int nr_ifaces;
+	double duration;	/* seconds */
+	unsigned int frames;	/* rtt count or burst size */
+	unsigned int rate;	/* frames/s per interface, 0 for max */
+	volatile int stop;	/* senders */
+	volatile int rx_stop;	/* receivers */
+	uint64_t start_ns;
+	uint64_t end_ns;
+	struct cpu_sample cpu_start;
+	struct cpu_sample cpu_end;
+	unsigned int bursts;
+	uint64_t burst_lost;
+	const char *isr_max;	/* driver debugfs isr_max file */
+	int have_isr;
+	uint64_t isr_ns_max;
+	unsigned int isr_frames_max;
+	unsigned int isr_port_frames_max[MAX_IFACES];
+	int isr_ports;
+	FILE *out;
+};
+
+struct scenario {
+	const char *name;
+	const char *help;
+	int (*run)(struct bench *b);
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static int open_socket(const char *name, int recv)
+{
+	struct sockaddr_can addr = { .can_family = AF_CAN };
+	struct timeval tv = { .tv_usec = 100000 };
+	int s;
+
+	s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (s < 0)
+		return -1;
+
+	addr.can_ifindex = if_nametoindex(name);
+	if (!addr.can_ifindex) {
+		close(s);
+		errno = ENODEV;
+		return -1;
+	}
+
+	if (recv) {
+		/* Wake up periodically to notice the end of the run */
+		setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	} else {
+		/* Sending sockets never read */
+		setsockopt(s, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+	}
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(s);
+		return -1;
+	}
+
+	return s;
+}
+
+static void read_iface_stats(struct iface *ifc, uint64_t *val)
+{
+	char path[128];
+	unsigned long long v;
+	unsigned int i;
+	FILE *f;
+
+	for (i = 0; i < 4; i++) {
+		val[i] = 0;
+		snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+			 ifc->name, iface_stats[i]);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%llu", &v) == 1)
+			val[i] = v;
+		fclose(f);
+	}
+}
+
+static void read_cpu(struct cpu_sample *cs)
+{
+	unsigned long long v[8];
+	FILE *f;
+	int i;
+
+	getrusage(RUSAGE_SELF, &cs->self);
+	memset(cs->stat, 0, sizeof(cs->stat));
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return;
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) == 8)
+		for (i = 0; i < 8; i++)
+			cs->stat[i] = v[i];
+	fclose(f);
+}
+
+/* Driver worst case interrupt statistics */
+
+static int write_isr_max(const char *path)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f)
+		return -1;
+	fputs("0\n", f);
+	return fclose(f);
+}
+
+static void read_isr_max(struct bench *b)
+{
+	unsigned long long v;
+	char key[32];
+	int port;
+	FILE *f;
+
+	f = fopen(b->isr_max, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", b->isr_max, strerror(errno));
+		return;
+	}
+
+	while (fscanf(f, "%31s %llu", key, &v) == 2) {
+		if (!strcmp(key, "isr_ns")) {
+			b->isr_ns_max = v;
+		} else if (!strcmp(key, "frames")) {
+			b->isr_frames_max = v;
+		} else if (sscanf(key, "port%d_frames", &port) == 1 &&
+			   port >= 0 && port < MAX_IFACES) {
+			b->isr_port_frames_max[port] = v;
+			if (port >= b->isr_ports)
+				b->isr_ports = port + 1;
+		}
+	}
+	b->have_isr = 1;
+	fclose(f);
+}
+
+/* First card found, if the driver is loaded and debugfs mounted */
+static const char *find_isr_max(void)
+{
+	static char path[256];
+	glob_t g;
+
+	if (glob("/sys/kernel/debug/advantech_can_pci/*/isr_max", 0, NULL,
+		 &g))
+		return NULL;
+	snprintf(path, sizeof(path), "%s", g.gl_pathv[0]);
+	globfree(&g);
+
+	return path;
+}
+
+/* Frame contents */
+
+static void make_frame(struct can_frame *cf, int src, uint32_t seq,
+		       int eff, int dlc)
+{
+	uint32_t t;
+
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = BENCH_ID_BASE + src;
+	if (eff)
+		cf->can_id = (cf->can_id << 18) | CAN_EFF_FLAG;
+	cf->can_dlc = dlc;
+
+	if (dlc >= 4)
+		memcpy(cf->data, &seq, 4);
+	if (dlc == 8) {
+		t = (uint32_t)now_ns();
+		memcpy(cf->data + 4, &t, 4);
+	}
+}
+
+static int frame_src(const struct can_frame *cf)
+{
+	canid_t id = cf->can_id;
+
+	if (id & CAN_EFF_FLAG)
+		id = (id & CAN_EFF_MASK) >> 18;
+	else
+		id &= CAN_SFF_MASK;
+
+	if (id < BENCH_ID_BASE || id >= BENCH_ID_BASE + MAX_IFACES)
+		return -1;
+
+	return id - BENCH_ID_BASE;
+}
+
+/* Threads */
+
+static uint64_t rx_count(struct iface *ifc)
+{
+	return __atomic_load_n(&ifc->rx_frames, __ATOMIC_RELAXED);
+}
+
+static int send_frame(struct bench *b, struct iface *ifc,
+		      struct can_frame *cf)
+{
+	while (!b->stop) {
+		if (write(ifc->tx_sock, cf, sizeof(*cf)) == sizeof(*cf)) {
+			ifc->tx_frames++;
+			return 0;
+		}
+		if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR)
+			return -1;
+
+		/* Queue full: count it and give the driver time */
+		ifc->tx_rejected++;
+		usleep(100);
+	}
+
+	return -1;
+}
+
+static void *rx_thread(void *arg)
+{
+	struct iface *ifc = arg;
+	struct bench *b = ifc->bench;
+	struct can_frame cf;
+	uint32_t seq, t;
+	int src;
+
+	while (!b->rx_stop) {
+		if (read(ifc->rx_sock, &cf, sizeof(cf)) != sizeof(cf))
+			continue;
+
+		src = frame_src(&cf);
+		if (src < 0 || src == ifc->index || src >= b->nr_ifaces)
+			continue;
+
+		__atomic_add_fetch(&ifc->rx_frames, 1, __ATOMIC_RELAXED);
+
+		if (cf.can_dlc >= 4) {
+			memcpy(&seq, cf.data, 4);
+			if (seq != ifc->next_seq[src])
+				ifc->rx_seq_gaps++;
+			ifc->next_seq[src] = seq + 1;
+		}
+		if (cf.can_dlc == 8 && ifc->nr_lat < MAX_SAMPLES) {
+			memcpy(&t, cf.data + 4, 4);
+			ifc->lat_ns[ifc->nr_lat++] = (uint32_t)now_ns() - t;
+		}
+	}
+
+	return NULL;
+}
+
+enum frame_mix {
+	MIX_DATA8,	/* 8 byte SFF frames */
+	MIX_SFF_EFF,	/* SFF and EFF alternate, DLC cycles through 0..8 */
+	MIX_WORST,	/* mostly empty SFF frames, every fourth 8 byte EFF */
+};
+
+/* Send continuously until stopped */
+struct tx_arg {
+	struct bench *b;
+	struct iface *ifc;
+	enum frame_mix mix;
+};
+
+static void *tx_thread(void *arg)
+{
+	struct tx_arg *ta = arg;
+	struct bench *b = ta->b;
+	struct iface *ifc = ta->ifc;
+	uint64_t next = now_ns();
+	uint64_t interval = b->rate ? 1000000000ULL / b->rate : 0;
+	struct can_frame cf;
+	uint32_t seq = 0, n;
+	int eff = 0, dlc = 8;
+
+	for (n = 0; !b->stop; n++) {
+		switch (ta->mix) {
+		case MIX_DATA8:
+			break;
+		case MIX_SFF_EFF:
+			eff = n & 1;
+			dlc = (n >> 1) % 9;
+			break;
+		case MIX_WORST:
+			/* Empty frames are the shortest on the bus and fill
+			 * the receive FIFO with the most frames; the EFF
+			 * frames take the most register reads to drain.
+			 */
+			eff = (n & 3) == 3;
+			dlc = eff ? 8 : 0;
+			break;
+		}
+		make_frame(&cf, ifc->index, seq, eff, dlc);
+		if (send_frame(b, ifc, &cf))
+			break;
+		/* Only frames with a payload of 4 or more carry it */
+		if (dlc >= 4)
+			seq++;
+
+		if (interval) {
+			next += interval;
+			sleep_until(next);
+		}
+	}
+
+	return NULL;
+}
+
+/* Scenarios */
+
+static int run_flood(struct bench *b, enum frame_mix mix)
+{
+	struct tx_arg ta[MAX_IFACES];
+	int i;
+
+	for (i = 0; i < b->nr_ifaces; i++) {
+		ta[i].b = b;
+		ta[i].ifc = &b->iface[i];
+		ta[i].mix = mix;
+		if (pthread_create(&b->iface[i].tx_thread, NULL, tx_thread,
+				   &ta[i]))
+			return -1;
+	}
+
+	usleep(b->duration * 1e6);
+	b->stop = 1;
+
+	for (i = 0; i < b->nr_ifaces; i++)
+		pthread_join(b->iface[i].tx_thread, NULL);
+
+	return 0;
+}
+
+static int run_saturate(struct bench *b)
+{
+	return run_flood(b, MIX_DATA8);
+}
+
+static int run_mixed(struct bench *b)
+{
+	return run_flood(b, MIX_SFF_EFF);
+}
+
+/* With all ports on one bus, every frame lands in the receive FIFOs of
+ * the other ports at the same time. The driver keeps the worst handler
+ * invocation in debugfs; reset it first and read it afterwards.
+ */
+static int run_isr_worst(struct bench *b)
+{
+	int err;
+
+	if (b->isr_max && write_isr_max(b->isr_max))
+		fprintf(stderr, "%s: cannot reset: %s\n", b->isr_max,
+			strerror(errno));
+
+	err = run_flood(b, MIX_WORST);
+
+	if (b->isr_max)
+		read_isr_max(b);
+
+	return err;
+}
+
+/* One frame at a time from the first interface to the second */
+static int run_rtt(struct bench *b)
+{
+	struct iface *tx = &b->iface[0], *rx = &b->iface[1];
+	uint64_t deadline, before;
+	struct can_frame cf;
+	unsigned int n;
+
+	for (n = 0; n < b->frames && !b->stop; n++) {
+		before = rx_count(rx);
+		make_frame(&cf, tx->index, n, 0, 8);
+		if (send_frame(b, tx, &cf))
+			return -1;
+
+		/* The receiver takes the time stamp; give up after 1 s */
+		deadline = now_ns() + 1000000000ULL;
+		while (rx_count(rx) == before && now_ns() < deadline)
+			usleep(20);
+	}
+
+	b->stop = 1;
+	return 0;
+}
+
+static uint64_t rx_total(struct bench *b)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < b->nr_ifaces; i++)
+		sum += rx_count(&b->iface[i]);
+
+	return sum;
+}
+
+/* Back-to-back bursts from the first interface, counting what arrives */
+static int run_burst(struct bench *b)
+{
+	struct iface *tx = &b->iface[0];
+	uint64_t end = now_ns() + b->duration * 1e9;
+	uint64_t expect, got;
+	struct can_frame cf;
+	uint32_t seq = 0;
+	unsigned int n;
+
+	while (now_ns() < end && !b->stop) {
+		got = rx_total(b);
+
+		for (n = 0; n < b->frames; n++) {
+			make_frame(&cf, tx->index, seq++, 0, 8);
+			if (write(tx->tx_sock, &cf, sizeof(cf)) == sizeof(cf))
+				tx->tx_frames++;
+			else
+				tx->tx_rejected++;
+		}
+
+		/* Let the burst drain before the next one */
+		usleep(200000);
+
+		expect = (uint64_t)b->frames * (b->nr_ifaces - 1);
+		got = rx_total(b) - got;
+		b->bursts++;
+		if (got < expect)
+			b->burst_lost += expect - got;
+	}
+
+	b->stop = 1;
+	return 0;
+}
+
+static const struct scenario scenarios[] = {
+	{ "rtt", "port to port latency, one frame at a time", run_rtt },
+	{ "saturate", "all ports send 8 byte frames at full rate",
+	  run_saturate },
+	{ "mixed", "all ports send a SFF/EFF and DLC mix at full rate",
+	  run_mixed },
+	{ "burst", "bursts of -n frames from the first port", run_burst },
+	{ "isr-worst", "all ports at full load with a worst case frame mix, "
+	  "reports the driver worst handler time", run_isr_worst },
+};
+
+/* Reporting */
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint32_t *v, size_t n, double p)
+{
+	size_t i;
+
+	if (!n)
+		return 0;
+	i = (size_t)(p / 100.0 * (n - 1) + 0.5);
+	return v[i] / 1000.0;
+}
+
+static void report(struct bench *b)
+{
+	FILE *o = b->out;
+	double secs = (b->end_ns - b->start_ns) / 1e9;
+	uint64_t tx = 0, rx = 0, rejected = 0, gaps = 0, busy, total;
+	uint64_t st[4] = { 0 };
+	uint32_t *lat;
+	size_t nr_lat = 0, k;
+	double cpu_self;
+	int i, j;
+
+	for (i = 0; i < b->nr_ifaces; i++)
+		nr_lat += b->iface[i].nr_lat;
+	lat = malloc((nr_lat + 1) * sizeof(*lat));
+	if (!lat)
+		nr_lat = 0;
+	for (i = 0, k = 0; lat && i < b->nr_ifaces; i++) {
+		memcpy(lat + k, b->iface[i].lat_ns,
+		       b->iface[i].nr_lat * sizeof(*lat));
+		k += b->iface[i].nr_lat;
+	}
+	qsort(lat, nr_lat, sizeof(*lat), cmp_u32);
+
+	fprintf(o, "{\n  \"scenario\": \"%s\",\n", b->scenario);
+	fprintf(o, "  \"duration_s\": %.3f,\n", secs);
+	fprintf(o, "  \"interfaces\": [\n");
+	for (i = 0; i < b->nr_ifaces; i++) {
+		struct iface *ifc = &b->iface[i];
+
+		fprintf(o, "    { \"name\": \"%s\", \"tx_frames\": %" PRIu64
+			", \"tx_rejected\": %" PRIu64 ", \"rx_frames\": %"
+			PRIu64 ", \"rx_seq_gaps\": %" PRIu64, ifc->name,
+			ifc->tx_frames, ifc->tx_rejected, ifc->rx_frames,
+			ifc->rx_seq_gaps);
+		for (j = 0; j < 4; j++) {
+			fprintf(o, ", \"%s\": %" PRIu64, iface_stats[j],
+				ifc->stats_end[j] - ifc->stats_start[j]);
+			st[j] += ifc->stats_end[j] - ifc->stats_start[j];
+		}
+		fprintf(o, " }%s\n", i + 1 < b->nr_ifaces ? "," : "");
+
+		tx += ifc->tx_frames;
+		rx += ifc->rx_frames;
+		rejected += ifc->tx_rejected;
+		gaps += ifc->rx_seq_gaps;
+	}
+	fprintf(o, "  ],\n");
+
+	fprintf(o, "  \"tx_frames\": %" PRIu64 ",\n  \"rx_frames\": %" PRIu64
+		",\n", tx, rx);
+	fprintf(o, "  \"tx_frames_per_s\": %.1f,\n  \"rx_frames_per_s\": %.1f,\n",
+		secs ? tx / secs : 0, secs ? rx / secs : 0);
+	fprintf(o, "  \"tx_rejected\": %" PRIu64 ",\n  \"rx_seq_gaps\": %"
+		PRIu64 ",\n", rejected, gaps);
+	fprintf(o, "  \"overruns\": %" PRIu64 ",\n  \"rx_dropped\": %" PRIu64
+		",\n", st[0] + st[1], st[2]);
+	if (b->bursts)
+		fprintf(o, "  \"bursts\": %u,\n  \"burst_frames_lost\": %"
+			PRIu64 ",\n", b->bursts, b->burst_lost);
+
+	if (b->have_isr) {
+		fprintf(o, "  \"isr\": { \"max_ns\": %" PRIu64
+			", \"max_frames\": %u, \"port_max_frames\": [",
+			b->isr_ns_max, b->isr_frames_max);
+		for (j = 0; j < b->isr_ports; j++)
+			fprintf(o, "%s%u", j ? ", " : "",
+				b->isr_port_frames_max[j]);
+		fprintf(o, "] },\n");
+	} else if (b->scenario && !strcmp(b->scenario, "isr-worst")) {
+		fprintf(o, "  \"isr\": null,\n");
+	}
+
+	fprintf(o, "  \"latency_us\": { \"samples\": %zu, \"p50\": %.1f, "
+		"\"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f },\n", nr_lat,
+		percentile(lat, nr_lat, 50), percentile(lat, nr_lat, 99),
+		percentile(lat, nr_lat, 99.9), percentile(lat, nr_lat, 100));
+
+	cpu_self = (b->cpu_end.self.ru_utime.tv_sec -
+		    b->cpu_start.self.ru_utime.tv_sec +
+		    b->cpu_end.self.ru_stime.tv_sec -
+		    b->cpu_start.self.ru_stime.tv_sec) +
+		   (b->cpu_end.self.ru_utime.tv_usec -
+		    b->cpu_start.self.ru_utime.tv_usec +
+		    b->cpu_end.self.ru_stime.tv_usec -
+		    b->cpu_start.self.ru_stime.tv_usec) / 1e6;
+	for (total = 0, j = 0; j < 8; j++)
+		total += b->cpu_end.stat[j] - b->cpu_start.stat[j];
+	busy = total - (b->cpu_end.stat[3] - b->cpu_start.stat[3]) -
+	       (b->cpu_end.stat[4] - b->cpu_start.stat[4]);
+	fprintf(o, "  \"cpu\": { \"process_pct\": %.1f, \"system_busy_pct\": "
+		"%.1f, \"irq_softirq_pct\": %.1f }\n",
+		secs ? 100 * cpu_self / secs : 0,
+		total ? 100.0 * busy / total : 0,
+		total ? 100.0 * (b->cpu_end.stat[5] - b->cpu_start.stat[5] +
+				  b->cpu_end.stat[6] - b->cpu_start.stat[6]) /
+			total : 0);
+	fprintf(o, "}\n");
+
+	free(lat);
+}
+
+static void usage(const char *prog)
+{
+	unsigned int i;
+
+	fprintf(stderr,
+		"Usage: %s [-i if0,if1,...] [-d seconds] [-n frames] "
+		"[-r rate] [-c isr_max] [-o file] <scenario>\n\n"
+		"  -i  interfaces on one bus (default can0,can1,can2,can3)\n"
+		"  -d  duration of flood and burst runs (default 5)\n"
+		"  -n  frames for rtt, burst size for burst (default 10000/64)\n"
+		"  -r  frames/s per interface for flood runs (default max)\n"
+		"  -c  driver debugfs isr_max file for isr-worst\n"
+		"      (default: first card found)\n"
+		"  -o  write the JSON result to file\n\n"
+		"Scenarios:\n", prog);
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+		fprintf(stderr, "  %-10s %s\n", scenarios[i].name,
+			scenarios[i].help);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	static struct bench bench;
+	struct bench *b = &bench;
+	const struct scenario *sc = NULL;
+	char *ifaces = "can0,can1,can2,can3", *name;
+	struct iface *ifc;
+	unsigned int i;
+	int opt;
+
+	b->duration = 5;
+	b->out = stdout;
+
+	while ((opt = getopt(argc, argv, "i:d:n:r:c:o:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			ifaces = optarg;
+			break;
+		case 'd':
+			b->duration = atof(optarg);
+			break;
+		case 'n':
+			b->frames = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			b->rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			b->isr_max = optarg;
+			break;
+		case 'o':
+			b->out = fopen(optarg, "w");
+			if (!b->out) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+		if (!strcmp(argv[optind], scenarios[i].name))
+			sc = &scenarios[i];
+	if (!sc)
+		usage(argv[0]);
+	b->scenario = sc->name;
+	if (!b->frames)
+		b->frames = sc->run == run_burst ? 64 : 10000;
+	if (sc->run == run_isr_worst && !b->isr_max)
+		b->isr_max = find_isr_max();
+
+	for (name = strtok(ifaces, ","); name; name = strtok(NULL, ",")) {
+		if (b->nr_ifaces == MAX_IFACES) {
+			fprintf(stderr, "At most %d interfaces\n", MAX_IFACES);
+			return 1;
+		}
+		ifc = &b->iface[b->nr_ifaces];
+		ifc->bench = b;
+		ifc->index = b->nr_ifaces++;
+		snprintf(ifc->name, sizeof(ifc->name), "%s", name);
+	}
+	if (b->nr_ifaces < 2) {
+		fprintf(stderr, "Need at least two interfaces; "
+			"give one vcan twice to use it alone\n");
+		return 1;
+	}
+
+	for (i = 0; i < (unsigned int)b->nr_ifaces; i++) {
+		ifc = &b->iface[i];
+		ifc->tx_sock = open_socket(ifc->name, 0);
+		ifc->rx_sock = open_socket(ifc->name, 1);
+		if (ifc->tx_sock < 0 || ifc->rx_sock < 0) {
+			perror(ifc->name);
+			return 1;
+		}
+		ifc->lat_ns = malloc(MAX_SAMPLES * sizeof(*ifc->lat_ns));
+		if (!ifc->lat_ns) {
+			perror("malloc");
+			return 1;
+		}
+		read_iface_stats(ifc, ifc->stats_start);
+	}
+
+	for (i = 0; i < (unsigned int)b->nr_ifaces; i++)
+		if (pthread_create(&b->iface[i].rx_thread, NULL, rx_thread,
+				   &b->iface[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+
+	read_cpu(&b->cpu_start);
+	b->start_ns = now_ns();
+
+	if (sc->run(b))
+		perror(sc->name);
+
+	/* Give the last frames time to arrive */
+	b->stop = 1;
+	usleep(100000);
+	b->rx_stop = 1;
+
+	b->end_ns = now_ns();
+	read_cpu(&b->cpu_end);
+
+	for (i = 0; i < (unsigned int)b->nr_ifaces; i++) {
+		pthread_join(b->iface[i].rx_thread, NULL);
+		read_iface_stats(&b->iface[i], b->iface[i].stats_end);
+	}
+
+	report(b);
+
+	return 0;
+}